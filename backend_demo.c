@@ -29,7 +29,8 @@ extern bool arch_supported(const char *arch_name) {
     return false;
 }
 
-extern bool is_indirect_branch(uint8_t *insn_data, size_t insn_size) {
+// Checks for the indirect calls this backend knows about
+static bool is_indirect_call(const uint8_t *insn_data, size_t insn_size) {
     if (arch == arm) {
         // Handles blx rn
         const uint32_t blx_variable_bits = 0xf000000f;
@@ -70,7 +71,39 @@ extern bool is_indirect_branch(uint8_t *insn_data, size_t insn_size) {
             }
         }
     }
+    return false;
+}
+
+extern bool is_indirect_branch(uint8_t *insn_data, size_t insn_size) {
+    if (is_indirect_call(insn_data, insn_size)) {
+        return true;
+    }
     // If we can't tell if the instruction is an indirect branch, let's use the
     // built-in backend as a fallback
     return is_indirect_branch_default_impl(insn_data, insn_size);
 }
+
+// Optionally backends may also classify all instructions in a block with a single call. This must
+// return the version of the batch ABI the backend was written for.
+extern uint32_t is_indirect_branch_batch_version(void) { return IBRESOLVER_BATCH_ABI_VERSION; }
+
+extern void is_indirect_branch_batch(const ibresolver_insn *insns, size_t num_insns,
+                                     bool *results) {
+    // Let the built-in backend classify the whole block first since it may use the surrounding
+    // instructions as context
+    is_indirect_branch_batch_default_impl(insns, num_insns, results);
+    for (size_t i = 0; i < num_insns; i++) {
+        if (is_indirect_call(insns[i].data, insns[i].size)) {
+            results[i] = true;
+        }
+    }
+}
+
+// Backends may also scan whole executable segments when they're first loaded so that instructions
+// which can't be indirect branches are never passed to the backend. Every indirect call found by
+// `is_indirect_call` is also an indirect branch to the built-in backend so its scan can be reused.
+extern uint32_t is_indirect_branch_scan_version(void) { return IBRESOLVER_SCAN_ABI_VERSION; }
+
+extern void is_indirect_branch_scan(const uint8_t *code, size_t size, uint64_t *candidates) {
+    is_indirect_branch_scan_default_impl(code, size, candidates);
+}
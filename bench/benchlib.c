@@ -0,0 +1,12 @@
+// Small functions in a shared library so every call from `plt.c` goes through the PLT
+__attribute__((noinline)) long lib_add(long x, long y) {
+    return x + y;
+}
+
+__attribute__((noinline)) long lib_mix(long x) {
+    return (x * 31) ^ (x >> 3);
+}
+
+__attribute__((noinline)) long lib_clamp(long x, long max) {
+    return (x > max) ? x % max : x;
+}
@@ -0,0 +1,93 @@
+// A stack-based bytecode interpreter which dispatches each opcode through a table of function
+// pointers, so every instruction executed by the guest program is an indirect call
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct vm {
+    const unsigned char *pc;
+    long stack[16];
+    int sp;
+    int halted;
+} vm;
+
+enum { PUSH, ADD, SUB, DUP, SWAP, DROP, DEC, JNZ, HALT, NUM_OPS };
+
+__attribute__((noinline)) static void op_push(vm *m) {
+    m->stack[m->sp++] = *m->pc++;
+}
+
+__attribute__((noinline)) static void op_add(vm *m) {
+    m->sp--;
+    m->stack[m->sp - 1] += m->stack[m->sp];
+}
+
+__attribute__((noinline)) static void op_sub(vm *m) {
+    m->sp--;
+    m->stack[m->sp - 1] -= m->stack[m->sp];
+}
+
+__attribute__((noinline)) static void op_dup(vm *m) {
+    m->stack[m->sp] = m->stack[m->sp - 1];
+    m->sp++;
+}
+
+__attribute__((noinline)) static void op_swap(vm *m) {
+    long top = m->stack[m->sp - 1];
+    m->stack[m->sp - 1] = m->stack[m->sp - 2];
+    m->stack[m->sp - 2] = top;
+}
+
+__attribute__((noinline)) static void op_drop(vm *m) {
+    m->sp--;
+}
+
+__attribute__((noinline)) static void op_dec(vm *m) {
+    m->stack[m->sp - 1]--;
+}
+
+// Jumps back by the operand if the top of the stack is not zero
+__attribute__((noinline)) static void op_jnz(vm *m) {
+    unsigned char offset = *m->pc++;
+    if (m->stack[m->sp - 1]) {
+        m->pc -= offset;
+    }
+}
+
+__attribute__((noinline)) static void op_halt(vm *m) {
+    m->halted = 1;
+}
+
+static void (*const ops[NUM_OPS])(vm *) = {
+    op_push, op_add, op_sub, op_dup, op_swap, op_drop, op_dec, op_jnz, op_halt,
+};
+
+int main(int argc, char **argv) {
+    long iters = (argc > 1) ? atol(argv[1]) : 100000;
+    // acc = 0; for (n = 250; n; n--) acc += 3 - 1;
+    unsigned char program[] = {
+        PUSH, 0,
+        PUSH, 250,
+        // loop:
+        SWAP,
+        PUSH, 3, PUSH, 1, SUB, ADD,
+        SWAP,
+        DEC,
+        JNZ, 11,
+        DROP,
+        HALT,
+    };
+    vm m;
+    // The loop counter is a one byte operand so run the program in rounds of 250 iterations
+    long acc = 0;
+    for (long done = 0; done < iters; done += 250) {
+        m.pc = program;
+        m.sp = 0;
+        m.halted = 0;
+        while (!m.halted) {
+            ops[*m.pc++](&m);
+        }
+        acc += m.stack[0];
+    }
+    printf("%ld\n", acc);
+    return 0;
+}
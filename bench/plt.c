@@ -0,0 +1,18 @@
+// Calls into a shared library in a hot loop. Each call jumps indirectly through the PLT.
+#include <stdio.h>
+#include <stdlib.h>
+
+long lib_add(long x, long y);
+long lib_mix(long x);
+long lib_clamp(long x, long max);
+
+int main(int argc, char **argv) {
+    long iters = (argc > 1) ? atol(argv[1]) : 300000;
+    long acc = 0;
+    for (long i = 0; i < iters; i++) {
+        acc = lib_add(acc, lib_mix(i));
+        acc = lib_clamp(acc, 1000003);
+    }
+    printf("%ld\n", acc);
+    return 0;
+}
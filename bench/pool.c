@@ -0,0 +1,68 @@
+// A pool of worker threads running callbacks from a shared task list, exercising indirect calls
+// from several vCPUs at once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_WORKERS 4
+
+typedef struct task {
+    long (*fn)(long);
+    long arg;
+} task;
+
+__attribute__((noinline)) static long square(long x) {
+    return x * x;
+}
+
+__attribute__((noinline)) static long negate(long x) {
+    return -x;
+}
+
+__attribute__((noinline)) static long halve(long x) {
+    return x / 2;
+}
+
+static long (*const callbacks[])(long) = {square, negate, halve};
+
+static task *tasks;
+static long num_tasks;
+static atomic_long next_task;
+static atomic_long result;
+
+static void *worker(void *arg) {
+    long sum = 0;
+    // Take tasks in small batches to keep the workers busy with callbacks rather than contention
+    for (;;) {
+        long start = atomic_fetch_add(&next_task, 64);
+        if (start >= num_tasks) {
+            break;
+        }
+        long end = (start + 64 < num_tasks) ? start + 64 : num_tasks;
+        for (long i = start; i < end; i++) {
+            sum += tasks[i].fn(tasks[i].arg);
+        }
+    }
+    atomic_fetch_add(&result, sum);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    num_tasks = (argc > 1) ? atol(argv[1]) : 400000;
+    tasks = malloc(num_tasks * sizeof(task));
+    for (long i = 0; i < num_tasks; i++) {
+        tasks[i].fn = callbacks[i % 3];
+        tasks[i].arg = i % 1000;
+    }
+    pthread_t workers[NUM_WORKERS];
+    for (int i = 0; i < NUM_WORKERS; i++) {
+        pthread_create(&workers[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < NUM_WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    printf("%ld\n", atomic_load(&result));
+    free(tasks);
+    return 0;
+}
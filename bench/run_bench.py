@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""
+Measures the overhead of the plugin on the guest programs in this directory. Each guest is run
+under bare QEMU and then under the plugin with each backend and output mode (see `MODES`). The
+results are written as JSON with one record per configuration, e.g.
+
+    {"arch": "x86-64", "guest": "interp", "backend": "builtin", "mode": "stream",
+     "seconds": 1.9, "bare_seconds": 0.2, "slowdown": 9.5, "edges": 900000,
+     "edges_per_sec": 473684.2}
+
+Build the guests with `make -C bench` (or `make bench` from the top-level directory) first.
+"""
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+GUESTS = ["interp", "virtual", "plt", "pool"]
+# The plugin arguments of each output mode measured. Binary output is converted with bin2csv to
+# count its edges.
+MODES = {
+    "stream": ["mode=stream"],
+    "aggregate": ["mode=aggregate"],
+    "bin": ["mode=stream", "format=bin"],
+    "bin-gzip": ["mode=stream", "format=bin", "compress=gzip"],
+    "profile": ["profile=topk:8"],
+}
+
+
+def run_timed(cmd, runs):
+    """
+    Runs `cmd` `runs` times and returns the median wall-clock time in seconds
+    """
+    times = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+        times.append(time.perf_counter() - start)
+    return statistics.median(times)
+
+
+def count_edges(output_path, plugin_args, bin2csv):
+    """
+    Counts the edges taken in an output file. Each row is one edge in `stream` mode while
+    `aggregate` mode and profiles have the number of times each edge was taken in the count column.
+    """
+    if "format=bin" in plugin_args:
+        csv_path = output_path + ".csv"
+        subprocess.run([bin2csv, output_path, csv_path], check=True)
+        output_path = csv_path
+    with_count = "mode=stream" not in plugin_args
+    edges = 0
+    with open(output_path) as f:
+        for line in f:
+            # Skip the header and any comment lines before it
+            if line.startswith("#") or line.startswith("callsite offset"):
+                continue
+            # The count follows the six offset, vaddr and image columns
+            edges += int(line.split(",")[6]) if with_count else 1
+    return edges
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--plugin", default=os.path.join(BENCH_DIR, "..", "libibresolver.so"),
+                        help="path to libibresolver.so")
+    parser.add_argument("--bin2csv", default=os.path.join(BENCH_DIR, "..", "bin2csv"),
+                        help="path to bin2csv for counting the edges of the binary modes")
+    parser.add_argument("--backend", action="append", default=[], metavar="NAME=PATH",
+                        help="a custom backend to also measure (may be repeated)")
+    parser.add_argument("--qemu-x86-64", default="qemu-x86_64", help="qemu-x86_64 binary")
+    parser.add_argument("--qemu-arm", default="qemu-arm", help="qemu-arm binary")
+    parser.add_argument("--arm-sysroot", default="/usr/arm-linux-gnueabihf",
+                        help="passed to qemu-arm with -L")
+    parser.add_argument("--guests", default=",".join(GUESTS), help="comma-separated guests")
+    parser.add_argument("--modes", default=",".join(MODES), help="comma-separated output modes")
+    parser.add_argument("--runs", type=int, default=3, help="runs per configuration")
+    parser.add_argument("--output", default=os.path.join(BENCH_DIR, "results.json"),
+                        help="where to write the results")
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    plugin = os.path.abspath(args.plugin)
+    bin2csv = os.path.abspath(args.bin2csv)
+    backends = [("builtin", None)]
+    for backend in args.backend:
+        name, _, path = backend.partition("=")
+        backends.append((name, os.path.abspath(path)))
+    arches = [
+        ("x86-64", [args.qemu_x86_64]),
+        ("arm32", [args.qemu_arm, "-L", args.arm_sysroot]),
+    ]
+
+    results = []
+    with tempfile.TemporaryDirectory() as tmp:
+        output_path = os.path.join(tmp, "output")
+        for arch, qemu in arches:
+            if not shutil.which(qemu[0]):
+                print(f"Skipping {arch} since {qemu[0]} was not found", file=sys.stderr)
+                continue
+            for guest in args.guests.split(","):
+                guest_path = os.path.join(BENCH_DIR, arch, guest)
+                if not os.path.exists(guest_path):
+                    print(f"Skipping {guest_path} since it was not built", file=sys.stderr)
+                    continue
+                bare_seconds = run_timed(qemu + [guest_path], args.runs)
+                for backend, backend_path in backends:
+                    for mode in args.modes.split(","):
+                        mode_args = MODES[mode]
+                        plugin_args = ",".join([plugin, f"output={output_path}"] + mode_args)
+                        if backend_path:
+                            plugin_args += f",backend={backend_path}"
+                        seconds = run_timed(qemu + ["-plugin", plugin_args, guest_path],
+                                            args.runs)
+                        edges = count_edges(output_path, mode_args, bin2csv)
+                        result = {
+                            "arch": arch,
+                            "guest": guest,
+                            "backend": backend,
+                            "mode": mode,
+                            "seconds": seconds,
+                            "bare_seconds": bare_seconds,
+                            "slowdown": seconds / bare_seconds,
+                            "edges": edges,
+                            "edges_per_sec": edges / seconds,
+                        }
+                        print(json.dumps(result), file=sys.stderr)
+                        results.append(result)
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+        f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
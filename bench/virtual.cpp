@@ -0,0 +1,56 @@
+// C++ virtual dispatch in a hot loop over objects of several derived types. The types are picked
+// at runtime so the compiler can't devirtualize the calls.
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+struct shape {
+    virtual ~shape() {}
+    virtual long area() const = 0;
+};
+
+struct square : shape {
+    long side;
+    explicit square(long side) : side(side) {}
+    long area() const override { return side * side; }
+};
+
+struct rectangle : shape {
+    long width, height;
+    rectangle(long width, long height) : width(width), height(height) {}
+    long area() const override { return width * height; }
+};
+
+struct triangle : shape {
+    long base, height;
+    triangle(long base, long height) : base(base), height(height) {}
+    long area() const override { return base * height / 2; }
+};
+
+int main(int argc, char **argv) {
+    long iters = (argc > 1) ? atol(argv[1]) : 1000;
+    std::vector<std::unique_ptr<shape>> shapes;
+    srand(1);
+    for (int i = 0; i < 1000; i++) {
+        switch (rand() % 3) {
+            case 0:
+                shapes.emplace_back(new square(i));
+                break;
+            case 1:
+                shapes.emplace_back(new rectangle(i, i + 1));
+                break;
+            default:
+                shapes.emplace_back(new triangle(i, i + 2));
+                break;
+        }
+    }
+    long total = 0;
+    for (long n = 0; n < iters; n++) {
+        for (const auto &s : shapes) {
+            total += s->area();
+        }
+    }
+    printf("%ld\n", total);
+    return 0;
+}
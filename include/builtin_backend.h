@@ -1,7 +1,62 @@
 #ifndef BUILTIN_BACKEND_H
 #define BUILTIN_BACKEND_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Version of the batch backend ABI (`is_indirect_branch_batch`) implemented by this plugin. A
+// backend's `is_indirect_branch_batch_version` must return this for its batch function to be used.
+#define IBRESOLVER_BATCH_ABI_VERSION 1
+
+// Version of the scan backend ABI (`is_indirect_branch_scan`) implemented by this plugin
+#define IBRESOLVER_SCAN_ABI_VERSION 1
+
+// Version of the branch kind backend ABI (`indirect_branch_kinds`) implemented by this plugin
+#define IBRESOLVER_KIND_ABI_VERSION 1
+
+// Describes an instruction classified by `indirect_branch_kinds`. The low bits hold one of the
+// kinds below and the high bits any of the flags.
+typedef uint8_t ibresolver_branch_kind;
+
+// Not an indirect branch
+#define IBRESOLVER_NOT_BRANCH 0
+// An indirect branch the backend can't describe further. It's treated as a conditional jump.
+#define IBRESOLVER_BRANCH_UNKNOWN 1
+#define IBRESOLVER_BRANCH_CALL 2
+#define IBRESOLVER_BRANCH_JUMP 3
+#define IBRESOLVER_BRANCH_RETURN 4
+#define IBRESOLVER_BRANCH_KIND_MASK 0x7
+// The branch may fall through to the next instruction
+#define IBRESOLVER_BRANCH_CONDITIONAL 0x8
+// The branch may switch between the ARM and THUMB instruction sets
+#define IBRESOLVER_BRANCH_MODE_SWITCH 0x10
+
+// An instruction passed to `is_indirect_branch_batch`
+typedef struct ibresolver_insn {
+    const uint8_t *data;
+    size_t size;
+    // The guest virtual address of the instruction
+    uint64_t vaddr;
+} ibresolver_insn;
+
 bool arch_supported_default_impl(const char *arch_name);
 bool is_indirect_branch_default_impl(uint8_t *insn_data, size_t insn_size);
+uint32_t is_indirect_branch_batch_version_default_impl(void);
+void is_indirect_branch_batch_default_impl(const ibresolver_insn *insns, size_t num_insns,
+                                           bool *results);
+uint32_t is_indirect_branch_scan_version_default_impl(void);
+void is_indirect_branch_scan_default_impl(const uint8_t *code, size_t size, uint64_t *candidates);
+uint32_t indirect_branch_kinds_version_default_impl(void);
+void indirect_branch_kinds_default_impl(const ibresolver_insn *insns, size_t num_insns,
+                                        ibresolver_branch_kind *results);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
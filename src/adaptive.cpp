@@ -0,0 +1,99 @@
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#include "adaptive.h"
+
+using namespace std;
+
+static const size_t initial_slots = 256;
+
+static bool enabled = false;
+static adaptive_config config = {.stable_executions = 0, .targets = 0, .batch = 0};
+static void (*retranslate)() = NULL;
+
+// The image IDs and offsets of callsites that saturated on any vCPU. Looked up once per translation
+// of a block with an indirect branch and only updated when a callsite saturates so the lock is
+// rarely contended.
+static set<pair<uint32_t, uint64_t>> saturated;
+static mutex saturated_lock;
+// Callsites that saturated since the last retranslation was requested
+static size_t pending = 0;
+// Set while a retranslation is requested but QEMU hasn't done it yet
+static atomic<bool> retranslating(false);
+static atomic<size_t> num_retranslations(0);
+
+void adaptive_init(const adaptive_config &new_config, void (*request_retranslation)()) {
+    enabled = true;
+    config = new_config;
+    retranslate = request_retranslation;
+}
+
+bool adaptive_enabled() { return enabled; }
+
+bool adaptive_saturated(const callsite_record *callsite) {
+    if (!callsite->resolved) {
+        return false;
+    }
+    lock_guard<mutex> guard(saturated_lock);
+    return saturated.count({callsite->offset.image, callsite->offset.offset}) != 0;
+}
+
+void adaptive_retranslated() {
+    num_retranslations++;
+    retranslating.store(false);
+}
+
+size_t adaptive_num_saturated() {
+    lock_guard<mutex> guard(saturated_lock);
+    return saturated.size();
+}
+
+size_t adaptive_num_retranslations() { return num_retranslations.load(); }
+
+callsite_tracker::callsite_tracker()
+    : stable_limit(config.stable_executions),
+      targets_limit(config.targets),
+      slots(initial_slots, {.callsite = UINT64_MAX, .stable = 0, .num_targets = 0, .targets = {}}),
+      num_callsites(0) {}
+
+callsite_tracker::callsite_targets &callsite_tracker::insert(uint64_t callsite) {
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if (2 * (num_callsites + 1) > slots.size()) {
+        vector<callsite_targets> old_slots(2 * slots.size(),
+                                           {.callsite = UINT64_MAX, .stable = 0,
+                                            .num_targets = 0, .targets = {}});
+        old_slots.swap(slots);
+        for (const callsite_targets &c : old_slots) {
+            if (c.callsite != UINT64_MAX) {
+                slots[probe(c.callsite)] = c;
+            }
+        }
+    }
+    num_callsites++;
+    callsite_targets &c = slots[probe(callsite)];
+    c = {.callsite = callsite, .stable = 0, .num_targets = 0, .targets = {}};
+    return c;
+}
+
+void callsite_tracker::saturate(const callsite_record *callsite) {
+    if (!callsite->resolved) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(saturated_lock);
+        // Another vCPU may have saturated the same callsite first
+        if (!saturated.insert({callsite->offset.image, callsite->offset.offset}).second ||
+            (++pending < config.batch)) {
+            return;
+        }
+        // Callsites saturating while a retranslation is pending count towards the next one since
+        // their blocks may have already been retranslated
+        if (retranslating.exchange(true)) {
+            return;
+        }
+        pending = 0;
+    }
+    retranslate();
+}
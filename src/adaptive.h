@@ -0,0 +1,113 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "callsites.h"
+
+// When a callsite is considered saturated, i.e. it keeps branching to the same few destinations so
+// recording more of its edges won't find anything new
+typedef struct adaptive_config {
+    // The number of executions in a row without a new destination
+    uint64_t stable_executions;
+    // Callsites with more destinations than this are never saturated. At most `max_targets`.
+    uint64_t targets;
+    // The number of newly saturated callsites that triggers retranslation
+    uint64_t batch;
+} adaptive_config;
+
+static const uint64_t max_targets = 8;
+
+// Enable adaptive de-instrumentation. `request_retranslation` is called (from a vCPU callback) once
+// `batch` callsites saturated since the last retranslation and should make QEMU retranslate all
+// blocks, e.g. with `qemu_plugin_reset`. `adaptive_retranslated` must be called once it's done.
+void adaptive_init(const adaptive_config &config, void (*request_retranslation)());
+
+// Whether `adaptive_init` was called
+bool adaptive_enabled();
+
+// Checks if a callsite saturated so it doesn't need to be instrumented when it's translated.
+// Callsites are identified by their image offset so one that saturated stays saturated wherever its
+// image is mapped, and code mapped at its old vaddr isn't affected. Unresolved callsites never
+// saturate.
+bool adaptive_saturated(const callsite_record *callsite);
+
+// Called once QEMU dropped the blocks translated before the last retranslation request
+void adaptive_retranslated();
+
+// The number of saturated callsites and retranslations so far
+size_t adaptive_num_saturated();
+size_t adaptive_num_retranslations();
+
+// Tracks the destinations of the callsites executed by one vCPU
+class callsite_tracker {
+   public:
+    callsite_tracker();
+
+    // Count an edge taken from `callsite`
+    void observe(const callsite_record *callsite, uint64_t dst_vaddr) {
+        callsite_targets &c = find_or_insert(callsite->index);
+        if (c.num_targets > targets_limit) {
+            return;
+        }
+        for (uint64_t i = 0; i < c.num_targets; i++) {
+            if (c.targets[i] == dst_vaddr) {
+                if (++c.stable == stable_limit) {
+                    saturate(callsite);
+                }
+                return;
+            }
+        }
+        // A new destination starts over. Callsites with too many are marked as unstable for good.
+        if (c.num_targets < targets_limit) {
+            c.targets[c.num_targets] = dst_vaddr;
+        }
+        c.num_targets++;
+        c.stable = 0;
+    }
+
+   private:
+    typedef struct callsite_targets {
+        // The index of the callsite's record or all-ones for unused slots. Records are never reused
+        // so a new record for the same vaddr starts over.
+        uint64_t callsite;
+        // Executions since the last new destination
+        uint64_t stable;
+        // More than `targets_limit` if the callsite is unstable
+        uint64_t num_targets;
+        uint64_t targets[max_targets];
+    } callsite_targets;
+
+    // Get the index of the slot holding the callsite or of the empty slot it would be inserted in
+    size_t probe(uint64_t callsite) const {
+        size_t mask = slots.size() - 1;
+        size_t i = ((callsite * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+        // Linear probing
+        while ((slots[i].callsite != callsite) && (slots[i].callsite != UINT64_MAX)) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    callsite_targets &find_or_insert(uint64_t callsite) {
+        size_t i = probe(callsite);
+        if (slots[i].callsite == callsite) {
+            return slots[i];
+        }
+        return insert(callsite);
+    }
+
+    callsite_targets &insert(uint64_t callsite);
+    static void saturate(const callsite_record *callsite);
+
+    // Copied from the config so the fast path doesn't need to load it
+    uint64_t stable_limit;
+    uint64_t targets_limit;
+    // The number of slots is always a power of two
+    std::vector<callsite_targets> slots;
+    size_t num_callsites;
+};
+
+#endif
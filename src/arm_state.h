@@ -0,0 +1,39 @@
+#ifndef ARM_STATE_H
+#define ARM_STATE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "builtin_backend.h"
+
+// The instruction set an arm block uses
+typedef enum arm_state {
+    UNKNOWN_STATE,
+    ARM_STATE,
+    THUMB_STATE,
+} arm_state;
+
+// Checks if the 4-byte instruction can't be a 32-bit THUMB instruction. Those always start with a
+// halfword with the top bits 0b11101, 0b11110 or 0b11111.
+static inline bool not_thumb32(const uint8_t *insn_data) {
+    return (insn_data[0] | (insn_data[1] << 8)) < 0xe800;
+}
+
+// Infer the instruction set of a block. THUMB blocks are identified by 2-byte instructions or
+// instructions that are not 4-byte aligned, and ARM blocks by instructions that can't be 32-bit
+// THUMB instructions.
+static inline arm_state infer_arm_state(const ibresolver_insn *insns, size_t num_insns) {
+    for (size_t i = 0; i < num_insns; i++) {
+        if ((insns[i].size == 2) || (insns[i].vaddr & 2)) {
+            return THUMB_STATE;
+        }
+    }
+    for (size_t i = 0; i < num_insns; i++) {
+        if ((insns[i].size == 4) && not_thumb32(insns[i].data)) {
+            return ARM_STATE;
+        }
+    }
+    return UNKNOWN_STATE;
+}
+
+#endif
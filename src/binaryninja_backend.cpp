@@ -1,35 +1,165 @@
+#include <dlfcn.h>
+
+#include <chrono>
 #include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
 #include "binaryninjacore.h"
 #include "binaryninjaapi.h"
+#include "builtin_backend.h"
 
 using namespace BinaryNinja;
 
+// Loading every bundled plugin takes seconds, which dominates short guest runs, so only the plugin
+// providing the guest's architecture is loaded and only once the first block is translated
+static const char *binja_arch_name = NULL;
+static const char *binja_arch_plugin = NULL;
+static bool arch_loaded = false;
 static BNArchitecture *arch = NULL;
 
+// Kinds of the instructions classified so far keyed by their bytes. Batches include instructions
+// the plugin already has cached when the rest of their block isn't, so this avoids asking Binary
+// Ninja about them again. QEMU serializes translations in user-mode so this doesn't need a lock.
+static std::unordered_map<std::string, ibresolver_branch_kind> kind_cache;
+
+// Clearing the cache past this many entries bounds its size
+static const size_t max_cached_kinds = 1 << 20;
+
 extern "C" bool arch_supported_default_impl(const char *arch_name) {
-    const char *binja_arch;
     if (!strcmp(arch_name, "arm")) {
-        binja_arch = "armv7";
+        binja_arch_name = "armv7";
+        binja_arch_plugin = "libarch_armv7.so";
     } else if (!strcmp(arch_name, "x86_64")) {
-        binja_arch = arch_name;
+        binja_arch_name = "x86_64";
+        binja_arch_plugin = "libarch_x86.so";
     } else {
         return false;
     }
+    return true;
+}
+
+// Load the bundled plugin registering the architecture by calling its entry point directly
+static bool load_arch_plugin() {
+    std::string path = std::string(BINJA_PLUGIN_DIR) + "/" + binja_arch_plugin;
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_GLOBAL);
+    if (!handle) {
+        std::cout << "WARNING: Could not load " << path << ": " << dlerror() << std::endl;
+        return false;
+    }
+    auto init = (bool (*)(void))dlsym(handle, "CorePluginInit");
+    return init && init();
+}
+
+// Get the architecture, loading it on first use. Returns NULL if it couldn't be loaded.
+static BNArchitecture *get_arch() {
+    if (arch_loaded) {
+        return arch;
+    }
+    arch_loaded = true;
+    auto start = std::chrono::steady_clock::now();
     BNSetBundledPluginDirectory(BINJA_PLUGIN_DIR);
-    BNInitPlugins(true);
-    arch = BNGetArchitectureByName(binja_arch);
+    if (load_arch_plugin()) {
+        arch = BNGetArchitectureByName(binja_arch_name);
+    }
+    if (!arch) {
+        std::cout << "WARNING: Loading every bundled Binary Ninja plugin since the "
+                  << binja_arch_name << " architecture plugin could not be loaded on its own"
+                  << std::endl;
+        BNInitPlugins(true);
+        arch = BNGetArchitectureByName(binja_arch_name);
+    }
+    double ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (arch) {
+        std::cout << "Loaded the Binary Ninja " << binja_arch_name << " architecture in " << ms
+                  << " ms" << std::endl;
+    } else {
+        std::cout << "ERROR: Could not load the Binary Ninja " << binja_arch_name
+                  << " architecture. No indirect branches will be found." << std::endl;
+    }
     return arch;
 }
 
-extern "C" bool is_indirect_branch_default_impl(uint8_t *insn_data, size_t insn_size) {
+// Classify an instruction with Binary Ninja. The kind only depends on the instruction's bytes, not
+// on `addr`, so it can be cached by `indirect_branch_kind_at`.
+static ibresolver_branch_kind decode_indirect_branch_kind(const uint8_t *insn_data,
+                                                          size_t insn_size, uint64_t addr) {
     BNInstructionInfo info;
-    BNGetInstructionInfo(arch, insn_data, 0 /* addr */, insn_size, &info);
+    BNGetInstructionInfo(arch, insn_data, addr, insn_size, &info);
+    ibresolver_branch_kind kind = IBRESOLVER_NOT_BRANCH;
+    ibresolver_branch_kind flags = 0;
     for (int i = 0; i < info.branchCount; i++) {
-        BNBranchType br = info.branchType[i];
-        if ((br == BNBranchType::CallDestination) ||
-            (br == BNBranchType::IndirectBranch)) {
-            return true;
+        switch (info.branchType[i]) {
+            case BNBranchType::CallDestination:
+                kind = IBRESOLVER_BRANCH_CALL;
+                break;
+            case BNBranchType::IndirectBranch:
+                kind = IBRESOLVER_BRANCH_JUMP;
+                break;
+            // Conditional branches also have an edge to the next instruction
+            case BNBranchType::TrueBranch:
+            case BNBranchType::FalseBranch:
+                flags |= IBRESOLVER_BRANCH_CONDITIONAL;
+                break;
+            default:
+                break;
+        }
+        if (info.branchArch[i] && (info.branchArch[i] != arch)) {
+            flags |= IBRESOLVER_BRANCH_MODE_SWITCH;
         }
     }
-    return false;
+    if (kind == IBRESOLVER_NOT_BRANCH) {
+        return kind;
+    }
+    if (info.archTransitionByTargetAddr) {
+        flags |= IBRESOLVER_BRANCH_MODE_SWITCH;
+    }
+    return kind | flags;
+}
+
+static ibresolver_branch_kind indirect_branch_kind_at(const uint8_t *insn_data, size_t insn_size,
+                                                      uint64_t addr) {
+    if (!get_arch()) {
+        return IBRESOLVER_NOT_BRANCH;
+    }
+    std::string key((const char *)insn_data, insn_size);
+    auto it = kind_cache.find(key);
+    if (it != kind_cache.end()) {
+        return it->second;
+    }
+    if (kind_cache.size() >= max_cached_kinds) {
+        kind_cache.clear();
+    }
+    ibresolver_branch_kind kind = decode_indirect_branch_kind(insn_data, insn_size, addr);
+    kind_cache.emplace(std::move(key), kind);
+    return kind;
+}
+
+extern "C" bool is_indirect_branch_default_impl(uint8_t *insn_data, size_t insn_size) {
+    return indirect_branch_kind_at(insn_data, insn_size, 0 /* addr */) != IBRESOLVER_NOT_BRANCH;
+}
+
+extern "C" uint32_t is_indirect_branch_batch_version_default_impl(void) {
+    return IBRESOLVER_BATCH_ABI_VERSION;
+}
+
+extern "C" void is_indirect_branch_batch_default_impl(const ibresolver_insn *insns,
+                                                      size_t num_insns, bool *results) {
+    for (size_t i = 0; i < num_insns; i++) {
+        results[i] = indirect_branch_kind_at(insns[i].data, insns[i].size, insns[i].vaddr) !=
+                     IBRESOLVER_NOT_BRANCH;
+    }
+}
+
+extern "C" uint32_t indirect_branch_kinds_version_default_impl(void) {
+    return IBRESOLVER_KIND_ABI_VERSION;
+}
+
+extern "C" void indirect_branch_kinds_default_impl(const ibresolver_insn *insns, size_t num_insns,
+                                                   ibresolver_branch_kind *results) {
+    for (size_t i = 0; i < num_insns; i++) {
+        results[i] = indirect_branch_kind_at(insns[i].data, insns[i].size, insns[i].vaddr);
+    }
 }
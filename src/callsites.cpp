@@ -0,0 +1,106 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "callsites.h"
+#include "format.h"
+
+using namespace std;
+
+// Records are allocated in chunks so their addresses never change
+static const size_t chunk_size = 1024;
+
+static vector<unique_ptr<callsite_record[]>> chunks;
+static size_t num_records = 0;
+// The latest record of each callsite
+static unordered_map<uint64_t, callsite_record *> callsites;
+
+// Guards all of the above. Translations are serialized by QEMU in user-mode so this is
+// uncontended.
+static mutex callsites_lock;
+
+// Must be called with `callsites_lock` held
+static callsite_record *new_record(uint64_t vaddr, size_t size, ibresolver_branch_kind kind,
+                                   optional<image_offset> offset) {
+    if (num_records == chunks.size() * chunk_size) {
+        chunks.push_back(make_unique<callsite_record[]>(chunk_size));
+    }
+    callsite_record *record = &chunks.back()[num_records % chunk_size];
+    record->vaddr = vaddr;
+    record->size = size;
+    record->kind = kind;
+    record->offset = offset.value_or(image_offset{});
+    record->resolved = offset.has_value();
+    record->index = num_records++;
+    return record;
+}
+
+callsite_record *callsite_record_get(uint64_t vaddr, size_t size, ibresolver_branch_kind kind) {
+    optional<image_offset> offset = guest_vaddr_to_offset(vaddr);
+    lock_guard<mutex> guard(callsites_lock);
+    callsite_record *&record = callsites[vaddr];
+    // Records are never modified once created other than their counters so vCPUs executing older
+    // translations can keep reading them
+    bool moved = record && (record->resolved != offset.has_value() ||
+                            (offset.has_value() && ((record->offset.offset != offset->offset) ||
+                                                    (record->offset.image != offset->image))));
+    if (!record || moved || (record->size != size) || (record->kind != kind)) {
+        record = new_record(vaddr, size, kind, offset);
+    }
+    return record;
+}
+
+vector<callsite_record *> callsite_records() {
+    lock_guard<mutex> guard(callsites_lock);
+    vector<callsite_record *> records;
+    records.reserve(num_records);
+    for (size_t i = 0; i < num_records; i++) {
+        records.push_back(&chunks[i / chunk_size][i % chunk_size]);
+    }
+    return records;
+}
+
+bool callsite_report_write(const char *path) {
+    vector<callsite_record *> records = callsite_records();
+    stable_sort(records.begin(), records.end(),
+                [](const callsite_record *a, const callsite_record *b) {
+                    return a->executed > b->executed;
+                });
+    // Write to a temporary file and rename it so readers never see a partial report
+    string tmp_path = string(path) + ".tmp." + to_string(getpid());
+    ofstream file(tmp_path);
+    if (file.fail()) {
+        return false;
+    }
+    file << "callsite offset,callsite vaddr,callsite ELF,branch kind,executed,taken,not taken,"
+         << "taken ratio\n";
+    for (const callsite_record *record : records) {
+        if (!record->executed || !record->resolved) {
+            continue;
+        }
+        // A fall through may be counted even if the branch's own counter was dropped by a race
+        // between vCPUs so the counts are clamped
+        uint64_t not_taken = min(record->not_taken.load(memory_order_relaxed), record->executed);
+        uint64_t taken = record->executed - not_taken;
+        char row[128];
+        snprintf(row, sizeof(row), "0x%lx,0x%lx,", record->offset.offset, record->vaddr);
+        file << row << image_name(record->offset.image) << ","
+             << branch_kind_name(record->kind) << "," << record->executed << ","
+             << taken << "," << not_taken << ",";
+        snprintf(row, sizeof(row), "%.4f\n", (double)taken / record->executed);
+        file << row;
+    }
+    file.close();
+    if (file.fail() || rename(tmp_path.c_str(), path)) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef CALLSITES_H
+#define CALLSITES_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "builtin_backend.h"
+#include "maps.h"
+
+// An indirect branch found while translating a block. A pointer to the record is passed as the
+// userdata of the callsite's execution callbacks so they don't need to look anything up.
+typedef struct callsite_record {
+    uint64_t vaddr;
+    // The size of the branch instruction so falling through can be told apart from taking it
+    size_t size;
+    ibresolver_branch_kind kind;
+    // Where the callsite was loaded from when it was translated. Only valid if `resolved`.
+    image_offset offset;
+    bool resolved;
+    // The position of the record in `callsite_records`
+    size_t index;
+    // Counted by inline ops without calling into the plugin
+    uint64_t executed;
+    // Executions where the next instruction ran after the branch, counted by the callback that saw
+    // it. Every other execution was taken. vCPUs running in parallel may count the same record so
+    // this is atomic.
+    std::atomic<uint64_t> not_taken;
+} callsite_record;
+
+// Get the record of the callsite at `vaddr` for a translation of its block, creating it on the
+// first translation. A new record is also created if the callsite now resolves to a different
+// image offset (e.g. another library was mapped at the same address) or its size or branch kind
+// changed (e.g. the code was modified). Records are allocated from an arena and never freed so blocks
+// translated earlier keep valid pointers.
+callsite_record *callsite_record_get(uint64_t vaddr, size_t size, ibresolver_branch_kind kind);
+
+// All records in the order they were created
+std::vector<callsite_record *> callsite_records();
+
+// Write the executions of each callsite to `path` as csv, sorted by decreasing executions
+//
+//     callsite offset,callsite vaddr,callsite ELF,branch kind,executed,taken,not taken,taken ratio
+//
+// Returns false if the file can't be written.
+bool callsite_report_write(const char *path);
+
+#endif
@@ -0,0 +1,173 @@
+#include <zlib.h>
+#ifdef IBRESOLVER_ZSTD
+#include <zstd.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+
+#include "compress.h"
+
+using namespace std;
+
+static const uint8_t gzip_magic[] = {0x1f, 0x8b};
+static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+// Add 16 to the window bits to get a gzip header and trailer instead of zlib's
+static const int gzip_window_bits = 15 + 16;
+#ifdef IBRESOLVER_ZSTD
+// zstd's default, which compresses about as well as gzip's default but much faster
+static const int zstd_level = 3;
+#endif
+
+static bool starts_with(string_view data, const uint8_t *magic, size_t size) {
+    return (data.size() >= size) && !memcmp(data.data(), magic, size);
+}
+
+bool compression_supported(compression c) {
+#ifndef IBRESOLVER_ZSTD
+    if (c == ZSTD) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+frame_compressor::frame_compressor(compression c) : format(c), stream(NULL) {
+    if (format == GZIP) {
+        z_stream *z = new z_stream();
+        if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip_window_bits, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete z;
+            z = NULL;
+        }
+        stream = z;
+    }
+#ifdef IBRESOLVER_ZSTD
+    if (format == ZSTD) {
+        stream = ZSTD_createCCtx();
+    }
+#endif
+}
+
+frame_compressor::~frame_compressor() {
+    if (!stream) {
+        return;
+    }
+    if (format == GZIP) {
+        deflateEnd((z_stream *)stream);
+        delete (z_stream *)stream;
+    }
+#ifdef IBRESOLVER_ZSTD
+    if (format == ZSTD) {
+        ZSTD_freeCCtx((ZSTD_CCtx *)stream);
+    }
+#endif
+}
+
+bool frame_compressor::compress(string_view data, string &out) {
+    if (!stream) {
+        return false;
+    }
+    size_t start = out.size();
+    if (format == GZIP) {
+        z_stream *z = (z_stream *)stream;
+        // Each frame is a complete gzip member so reset the stream instead of continuing it
+        if (deflateReset(z) != Z_OK) {
+            return false;
+        }
+        out.resize(start + deflateBound(z, data.size()));
+        z->next_in = (Bytef *)data.data();
+        z->avail_in = data.size();
+        z->next_out = (Bytef *)out.data() + start;
+        z->avail_out = out.size() - start;
+        // The output buffer is large enough for the whole member so this finishes in one call
+        int ret = deflate(z, Z_FINISH);
+        out.resize(out.size() - z->avail_out);
+        return ret == Z_STREAM_END;
+    }
+#ifdef IBRESOLVER_ZSTD
+    if (format == ZSTD) {
+        out.resize(start + ZSTD_compressBound(data.size()));
+        size_t size = ZSTD_compressCCtx((ZSTD_CCtx *)stream, out.data() + start,
+                                        out.size() - start, data.data(), data.size(), zstd_level);
+        if (ZSTD_isError(size)) {
+            out.resize(start);
+            return false;
+        }
+        out.resize(start + size);
+        return true;
+    }
+#endif
+    return false;
+}
+
+static bool decompress_gzip(string_view data, string &out) {
+    z_stream z = {};
+    if (inflateInit2(&z, gzip_window_bits) != Z_OK) {
+        return false;
+    }
+    z.next_in = (Bytef *)data.data();
+    z.avail_in = data.size();
+    char buf[64 * 1024];
+    bool ok;
+    while (true) {
+        z.next_out = (Bytef *)buf;
+        z.avail_out = sizeof(buf);
+        int ret = inflate(&z, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - z.avail_out);
+        if (ret == Z_STREAM_END) {
+            if (!z.avail_in) {
+                ok = true;
+                break;
+            }
+            // Start decoding the next member
+            inflateReset(&z);
+        } else if ((ret != Z_OK) || ((z.avail_out != 0) && (z.avail_in == 0))) {
+            // A corrupt member, or input that ended in the middle of one
+            ok = false;
+            break;
+        }
+    }
+    inflateEnd(&z);
+    return ok;
+}
+
+#ifdef IBRESOLVER_ZSTD
+static bool decompress_zstd(string_view data, string &out) {
+    ZSTD_DCtx *ctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in = {data.data(), data.size(), 0};
+    char buf[64 * 1024];
+    // Zero once a frame is complete, otherwise a hint of how much input the frame still needs
+    size_t ret;
+    while (true) {
+        ZSTD_outBuffer buf_out = {buf, sizeof(buf), 0};
+        ret = ZSTD_decompressStream(ctx, &buf_out, &in);
+        if (ZSTD_isError(ret)) {
+            break;
+        }
+        out.append(buf, buf_out.pos);
+        // Keep going while there's input or the buffer was too small for the pending output
+        if ((in.pos == in.size) && (buf_out.pos < buf_out.size)) {
+            break;
+        }
+    }
+    ZSTD_freeDCtx(ctx);
+    return ret == 0;
+}
+#endif
+
+bool decompress_frames(string_view data, string &out) {
+    if (starts_with(data, gzip_magic, sizeof(gzip_magic))) {
+        return decompress_gzip(data, out);
+    }
+    if (starts_with(data, zstd_magic, sizeof(zstd_magic))) {
+#ifdef IBRESOLVER_ZSTD
+        return decompress_zstd(data, out);
+#else
+        return false;
+#endif
+    }
+    out.append(data);
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+#include <string_view>
+
+// Compression of the output file. Each block of output is compressed into a separate gzip member
+// or zstd frame which can be decoded on its own, and the concatenation of the frames is a valid
+// gzip or zstd file (e.g. for `zcat` or `zstdcat`). If the guest is killed the output is still
+// readable up to the last complete frame.
+typedef enum compression {
+    NO_COMPRESSION,
+    GZIP,
+    // Only available if built with `make ZSTD=1`
+    ZSTD,
+} compression;
+
+// Whether the plugin was built with support for a compression format
+bool compression_supported(compression c);
+
+// Compresses blocks of output. Each instance must only be used by one thread at a time.
+class frame_compressor {
+   public:
+    explicit frame_compressor(compression c);
+    ~frame_compressor();
+    frame_compressor(const frame_compressor &) = delete;
+    frame_compressor &operator=(const frame_compressor &) = delete;
+
+    // Append `data` compressed as one frame to `out`. Returns false if compression failed.
+    bool compress(std::string_view data, std::string &out);
+
+   private:
+    compression format;
+    // The zlib or zstd stream reused across frames so its buffers are only allocated once
+    void *stream;
+};
+
+// Decompress all of the frames in `data` into `out` if it starts with the gzip or zstd magic bytes,
+// otherwise copy it as is. Returns false if `data` is compressed but can't be decoded, e.g. if the
+// last frame is truncated. `out` still holds everything decoded up to the error.
+bool decompress_frames(std::string_view data, std::string &out);
+
+#endif
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <iostream>
+
+#include "edge_table.h"
+
+using namespace std;
+
+static const size_t initial_slots = 1024;
+
+static size_t hash_edge(uint64_t callsite_vaddr, uint64_t dst_vaddr) {
+    // Mix the two addresses with multiplicative hashing. The high bits are the best mixed so fold
+    // them into the low bits used to index the table.
+    uint64_t h = (callsite_vaddr * 0x9e3779b97f4a7c15ULL) ^ (dst_vaddr * 0xc2b2ae3d27d4eb4fULL);
+    return h ^ (h >> 32);
+}
+
+edge_table::edge_table() : slots(initial_slots), num_edges(0), cache(cache_size) { clear_cache(); }
+
+void edge_table::clear_cache() {
+    // No instruction can have the all-ones address so this entry never matches
+    for (last_dst &cached : cache) {
+        cached = {.callsite_vaddr = UINT64_MAX, .dst_vaddr = UINT64_MAX, .slot = 0};
+    }
+}
+
+size_t edge_table::probe(uint64_t callsite_vaddr, uint64_t dst_vaddr) const {
+    size_t mask = slots.size() - 1;
+    size_t i = hash_edge(callsite_vaddr, dst_vaddr) & mask;
+    // Linear probing
+    while (slots[i].count != 0) {
+        if ((slots[i].callsite_vaddr == callsite_vaddr) && (slots[i].dst_vaddr == dst_vaddr)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void edge_table::reserve_one() {
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if (2 * (num_edges + 1) <= slots.size()) {
+        return;
+    }
+    vector<edge> old_slots(2 * slots.size());
+    old_slots.swap(slots);
+    for (const edge &e : old_slots) {
+        if (e.count != 0) {
+            slots[probe(e.callsite_vaddr, e.dst_vaddr)] = e;
+        }
+    }
+    // The cached slot indices are no longer valid
+    clear_cache();
+}
+
+size_t edge_table::find_or_insert(uint64_t callsite_vaddr, uint64_t dst_vaddr,
+                                  ibresolver_branch_kind kind) {
+    reserve_one();
+    size_t i = probe(callsite_vaddr, dst_vaddr);
+    if (slots[i].count != 0) {
+        return i;
+    }
+    // Resolve the offsets once per edge rather than on every execution
+    optional<image_offset> callsite = guest_vaddr_to_offset(callsite_vaddr);
+    optional<image_offset> dst = guest_vaddr_to_offset(dst_vaddr);
+    if (!callsite.has_value()) {
+        cout << "ERROR: Unable to find callsite address in /proc/self/maps" << endl;
+    }
+    if (!dst.has_value()) {
+        cout << "ERROR: Unable to find destination address in /proc/self/maps" << endl;
+    }
+    edge &e = slots[i];
+    e.callsite_vaddr = callsite_vaddr;
+    e.dst_vaddr = dst_vaddr;
+    e.resolved = callsite.has_value() && dst.has_value();
+    if (e.resolved) {
+        e.callsite = callsite.value();
+        e.dst = dst.value();
+    }
+    e.kind = kind;
+    // The slot counts as used once the caller increments the count which happens right after this
+    // returns
+    e.count = 0;
+    num_edges++;
+    return i;
+}
+
+void edge_table::merge(const edge_table &other) {
+    for (const edge &e : other.slots) {
+        if (e.count == 0) {
+            continue;
+        }
+        reserve_one();
+        size_t i = probe(e.callsite_vaddr, e.dst_vaddr);
+        if (slots[i].count == 0) {
+            // Keep the offsets resolved when the edge was first taken since the memory map may
+            // have changed since then
+            slots[i] = e;
+            num_edges++;
+        } else {
+            slots[i].count += e.count;
+        }
+    }
+}
+
+vector<edge> edge_table::edges() const {
+    vector<edge> taken;
+    taken.reserve(num_edges);
+    for (const edge &e : slots) {
+        if (e.count != 0) {
+            taken.push_back(e);
+        }
+    }
+    sort(taken.begin(), taken.end(), [](const edge &a, const edge &b) {
+        if (a.count != b.count) {
+            return a.count > b.count;
+        }
+        if (a.callsite_vaddr != b.callsite_vaddr) {
+            return a.callsite_vaddr < b.callsite_vaddr;
+        }
+        return a.dst_vaddr < b.dst_vaddr;
+    });
+    return taken;
+}
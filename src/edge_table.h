@@ -0,0 +1,81 @@
+#ifndef EDGE_TABLE_H
+#define EDGE_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "builtin_backend.h"
+#include "maps.h"
+
+typedef struct edge {
+    uint64_t callsite_vaddr;
+    uint64_t dst_vaddr;
+    // The number of times the edge was taken. This is zero for unused slots in the table.
+    uint64_t count;
+    // Offsets resolved the first time the edge is taken. If either address could not be found in
+    // /proc/self/maps `resolved` is false.
+    image_offset callsite;
+    image_offset dst;
+    bool resolved;
+    // The kind of the callsite's branch when the edge was first taken. Unknown for edges read from
+    // the binary format which doesn't store kinds.
+    ibresolver_branch_kind kind;
+} edge;
+
+// Open-addressing hash table counting the number of times each indirect branch edge is taken. A
+// direct-mapped cache of the last destination of each callsite sits in front of the table so that
+// callsites which always branch to the same destination don't have to hash and probe the table.
+class edge_table {
+   public:
+    edge_table();
+
+    // Count one execution of the edge from `callsite_vaddr` (a branch of `kind`) to `dst_vaddr`
+    void add(uint64_t callsite_vaddr, uint64_t dst_vaddr, ibresolver_branch_kind kind) {
+        last_dst &cached = cache[cache_index(callsite_vaddr)];
+        if ((cached.callsite_vaddr != callsite_vaddr) || (cached.dst_vaddr != dst_vaddr)) {
+            // Inserting may grow the table which clears the cache, so only fill in the entry after
+            size_t slot = find_or_insert(callsite_vaddr, dst_vaddr, kind);
+            cached.callsite_vaddr = callsite_vaddr;
+            cached.dst_vaddr = dst_vaddr;
+            cached.slot = slot;
+        }
+        slots[cached.slot].count++;
+    }
+
+    // Add the counts of all edges in `other` to this table
+    void merge(const edge_table &other);
+
+    // Get the edges that were taken at least once sorted by decreasing count
+    std::vector<edge> edges() const;
+
+   private:
+    // An entry in the callsite cache. `slot` is the index of the edge in `slots`.
+    typedef struct last_dst {
+        uint64_t callsite_vaddr;
+        uint64_t dst_vaddr;
+        size_t slot;
+    } last_dst;
+
+    static const size_t cache_size = 4096;
+
+    static size_t cache_index(uint64_t callsite_vaddr) {
+        // Instructions are at least 2-byte aligned on arm
+        return (callsite_vaddr >> 1) & (cache_size - 1);
+    }
+
+    // Get the index of the edge in `slots`, inserting it if it's not in the table yet
+    size_t find_or_insert(uint64_t callsite_vaddr, uint64_t dst_vaddr, ibresolver_branch_kind kind);
+    // Get the index of the slot holding the edge or of the empty slot it would be inserted in
+    size_t probe(uint64_t callsite_vaddr, uint64_t dst_vaddr) const;
+    // Grow the table if needed to make room for one more edge
+    void reserve_one();
+    void clear_cache();
+
+    // The number of slots is always a power of two
+    std::vector<edge> slots;
+    size_t num_edges;
+    std::vector<last_dst> cache;
+};
+
+#endif
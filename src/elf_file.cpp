@@ -0,0 +1,242 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "elf_file.h"
+
+using namespace std;
+
+// A read-only mapping of a whole file
+typedef struct mapped_file {
+    const uint8_t *data;
+    size_t size;
+} mapped_file;
+
+static mapped_file map_file(const string &path) {
+    mapped_file file = {.data = NULL, .size = 0};
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return file;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            file.data = (const uint8_t *)data;
+            file.size = st.st_size;
+        }
+    }
+    close(fd);
+    return file;
+}
+
+static void unmap_file(mapped_file &file) {
+    if (file.data) {
+        munmap((void *)file.data, file.size);
+    }
+}
+
+static bool in_bounds(const mapped_file &file, uint64_t offset, uint64_t size) {
+    return (offset <= file.size) && (size <= file.size - offset);
+}
+
+// Search the notes in [offset, offset + size) for the build ID
+static string find_build_id(const mapped_file &file, uint64_t offset, uint64_t size) {
+    if (!in_bounds(file, offset, size)) {
+        return "";
+    }
+    // The note header has the same layout for ELF32 and ELF64
+    uint64_t end = offset + size;
+    while (offset + sizeof(Elf32_Nhdr) <= end) {
+        Elf32_Nhdr note;
+        memcpy(&note, file.data + offset, sizeof(note));
+        uint64_t name_offset = offset + sizeof(note);
+        uint64_t desc_offset = name_offset + ((note.n_namesz + 3) & ~3ULL);
+        uint64_t next = desc_offset + ((note.n_descsz + 3) & ~3ULL);
+        if (next > end) {
+            break;
+        }
+        if ((note.n_type == NT_GNU_BUILD_ID) && (note.n_namesz == sizeof("GNU")) &&
+            !memcmp(file.data + name_offset, "GNU", sizeof("GNU"))) {
+            static const char digits[] = "0123456789abcdef";
+            string id;
+            for (uint32_t i = 0; i < note.n_descsz; i++) {
+                uint8_t byte = file.data[desc_offset + i];
+                id += digits[byte >> 4];
+                id += digits[byte & 0xf];
+            }
+            return id;
+        }
+        offset = next;
+    }
+    return "";
+}
+
+template <typename Ehdr, typename Phdr>
+static string build_id_from_segments(const mapped_file &file) {
+    Ehdr ehdr;
+    memcpy(&ehdr, file.data, sizeof(ehdr));
+    if (!in_bounds(file, ehdr.e_phoff, (uint64_t)ehdr.e_phnum * sizeof(Phdr))) {
+        return "";
+    }
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        Phdr phdr;
+        memcpy(&phdr, file.data + ehdr.e_phoff + i * sizeof(Phdr), sizeof(phdr));
+        if (phdr.p_type != PT_NOTE) {
+            continue;
+        }
+        string id = find_build_id(file, phdr.p_offset, phdr.p_filesz);
+        if (!id.empty()) {
+            return id;
+        }
+    }
+    return "";
+}
+
+string elf_build_id(const string &path) {
+    mapped_file file = map_file(path);
+    string id;
+    if (in_bounds(file, 0, EI_NIDENT) && !memcmp(file.data, ELFMAG, SELFMAG)) {
+        if ((file.data[EI_CLASS] == ELFCLASS64) && in_bounds(file, 0, sizeof(Elf64_Ehdr))) {
+            id = build_id_from_segments<Elf64_Ehdr, Elf64_Phdr>(file);
+        } else if ((file.data[EI_CLASS] == ELFCLASS32) && in_bounds(file, 0, sizeof(Elf32_Ehdr))) {
+            id = build_id_from_segments<Elf32_Ehdr, Elf32_Phdr>(file);
+        }
+    }
+    unmap_file(file);
+    return id;
+}
+
+template <typename Ehdr, typename Phdr>
+static void executable_segments(const mapped_file &file, vector<elf_segment> &segments) {
+    Ehdr ehdr;
+    memcpy(&ehdr, file.data, sizeof(ehdr));
+    if (!in_bounds(file, ehdr.e_phoff, (uint64_t)ehdr.e_phnum * sizeof(Phdr))) {
+        return;
+    }
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        Phdr phdr;
+        memcpy(&phdr, file.data + ehdr.e_phoff + i * sizeof(Phdr), sizeof(phdr));
+        if ((phdr.p_type == PT_LOAD) && (phdr.p_flags & PF_X) &&
+            in_bounds(file, phdr.p_offset, phdr.p_filesz)) {
+            segments.push_back({.offset = phdr.p_offset, .size = phdr.p_filesz});
+        }
+    }
+}
+
+vector<elf_segment> elf_executable_segments(const string &path) {
+    mapped_file file = map_file(path);
+    vector<elf_segment> segments;
+    if (in_bounds(file, 0, EI_NIDENT) && !memcmp(file.data, ELFMAG, SELFMAG)) {
+        if ((file.data[EI_CLASS] == ELFCLASS64) && in_bounds(file, 0, sizeof(Elf64_Ehdr))) {
+            executable_segments<Elf64_Ehdr, Elf64_Phdr>(file, segments);
+        } else if ((file.data[EI_CLASS] == ELFCLASS32) && in_bounds(file, 0, sizeof(Elf32_Ehdr))) {
+            executable_segments<Elf32_Ehdr, Elf32_Phdr>(file, segments);
+        }
+    }
+    unmap_file(file);
+    return segments;
+}
+
+// Convert a vaddr to a file offset using the loadable segments
+template <typename Phdr>
+static bool vaddr_to_offset(const vector<Phdr> &segments, uint64_t vaddr, uint64_t &offset) {
+    for (const Phdr &phdr : segments) {
+        if ((vaddr >= phdr.p_vaddr) && (vaddr - phdr.p_vaddr < phdr.p_filesz)) {
+            offset = vaddr - phdr.p_vaddr + phdr.p_offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename Ehdr, typename Phdr, typename Shdr, typename Sym>
+static void function_symbols(const mapped_file &file, vector<elf_symbol> &symbols) {
+    Ehdr ehdr;
+    memcpy(&ehdr, file.data, sizeof(ehdr));
+    if (!in_bounds(file, ehdr.e_phoff, (uint64_t)ehdr.e_phnum * sizeof(Phdr)) ||
+        !in_bounds(file, ehdr.e_shoff, (uint64_t)ehdr.e_shnum * sizeof(Shdr))) {
+        return;
+    }
+    vector<Phdr> segments;
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        Phdr phdr;
+        memcpy(&phdr, file.data + ehdr.e_phoff + i * sizeof(Phdr), sizeof(phdr));
+        if (phdr.p_type == PT_LOAD) {
+            segments.push_back(phdr);
+        }
+    }
+    vector<Shdr> sections(ehdr.e_shnum);
+    if (ehdr.e_shnum) {
+        memcpy(sections.data(), file.data + ehdr.e_shoff, ehdr.e_shnum * sizeof(Shdr));
+    }
+    for (const Shdr &symtab : sections) {
+        if (((symtab.sh_type != SHT_SYMTAB) && (symtab.sh_type != SHT_DYNSYM)) ||
+            (symtab.sh_link >= sections.size()) ||
+            !in_bounds(file, symtab.sh_offset, symtab.sh_size)) {
+            continue;
+        }
+        const Shdr &strtab = sections[symtab.sh_link];
+        if (!in_bounds(file, strtab.sh_offset, strtab.sh_size)) {
+            continue;
+        }
+        const char *strings = (const char *)file.data + strtab.sh_offset;
+        for (uint64_t pos = 0; pos + sizeof(Sym) <= symtab.sh_size; pos += sizeof(Sym)) {
+            Sym sym;
+            memcpy(&sym, file.data + symtab.sh_offset + pos, sizeof(sym));
+            // The type is in the low 4 bits of st_info for both ELF32 and ELF64
+            int type = sym.st_info & 0xf;
+            if (((type != STT_FUNC) && (type != STT_GNU_IFUNC)) || (sym.st_shndx == SHN_UNDEF) ||
+                (sym.st_name >= strtab.sh_size)) {
+                continue;
+            }
+            uint64_t vaddr = sym.st_value;
+            // The lowest bit of THUMB function addresses is set
+            if (ehdr.e_machine == EM_ARM) {
+                vaddr &= ~1ULL;
+            }
+            uint64_t offset;
+            if (!vaddr_to_offset(segments, vaddr, offset)) {
+                continue;
+            }
+            const char *name = strings + sym.st_name;
+            size_t max_len = strtab.sh_size - sym.st_name;
+            symbols.push_back({.offset = offset,
+                               .size = sym.st_size,
+                               .name = string(name, strnlen(name, max_len))});
+        }
+    }
+}
+
+vector<elf_symbol> elf_function_symbols(const string &path) {
+    mapped_file file = map_file(path);
+    vector<elf_symbol> symbols;
+    if (in_bounds(file, 0, EI_NIDENT) && !memcmp(file.data, ELFMAG, SELFMAG)) {
+        if ((file.data[EI_CLASS] == ELFCLASS64) && in_bounds(file, 0, sizeof(Elf64_Ehdr))) {
+            function_symbols<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Sym>(file, symbols);
+        } else if ((file.data[EI_CLASS] == ELFCLASS32) && in_bounds(file, 0, sizeof(Elf32_Ehdr))) {
+            function_symbols<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Sym>(file, symbols);
+        }
+    }
+    unmap_file(file);
+    // Functions are often in both .symtab and .dynsym so keep one symbol per offset, preferring
+    // ones with a size
+    stable_sort(symbols.begin(), symbols.end(), [](const elf_symbol &a, const elf_symbol &b) {
+        if (a.offset != b.offset) {
+            return a.offset < b.offset;
+        }
+        return (a.size != 0) && (b.size == 0);
+    });
+    symbols.erase(unique(symbols.begin(), symbols.end(),
+                         [](const elf_symbol &a, const elf_symbol &b) {
+                             return a.offset == b.offset;
+                         }),
+                  symbols.end());
+    return symbols;
+}
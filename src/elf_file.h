@@ -0,0 +1,35 @@
+#ifndef ELF_FILE_H
+#define ELF_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Get the GNU build ID of an ELF file as a hex string. Returns an empty string if the file can't be
+// read, isn't an ELF file or doesn't have a build ID.
+std::string elf_build_id(const std::string &path);
+
+// A range of an ELF file loaded by a PT_LOAD segment
+typedef struct elf_segment {
+    uint64_t offset;
+    uint64_t size;
+} elf_segment;
+
+// Get the file ranges of the executable loadable segments of an ELF file. Returns an empty vector if
+// the file can't be read or isn't an ELF file.
+std::vector<elf_segment> elf_executable_segments(const std::string &path);
+
+typedef struct elf_symbol {
+    // The file offset of the start of the function
+    uint64_t offset;
+    // Zero if the symbol doesn't have a size
+    uint64_t size;
+    std::string name;
+} elf_symbol;
+
+// Get the function symbols from the .symtab and .dynsym sections of an ELF file sorted by offset
+// with one symbol per offset. Symbol values are converted from vaddrs to file offsets using the
+// loadable segments. Returns an empty vector if the file can't be read or has no symbols.
+std::vector<elf_symbol> elf_function_symbols(const std::string &path);
+
+#endif
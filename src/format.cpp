@@ -0,0 +1,356 @@
+#include <cstdio>
+#include <cstring>
+
+#include "format.h"
+
+using namespace std;
+
+string csv_header(bool with_count, bool with_symbols, bool with_image_ids, bool with_branch_kinds,
+                  bool with_profile, const sampling_config *sampling,
+                  const sampling_drops &dropped) {
+    string header;
+    if (sampling) {
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "# sample=1/%lu first=%lu budget=%lu dropped_sample=%020lu dropped_first=%020lu "
+                 "dropped_budget=%020lu\n",
+                 sampling->period, sampling->first, sampling->budget, dropped.period,
+                 dropped.first, dropped.budget);
+        header += line;
+    }
+    header += "callsite offset,dest offset,callsite vaddr,dest vaddr,";
+    header += with_image_ids ? "callsite image,dest image" : "callsite ELF,dest ELF";
+    if (with_symbols) {
+        header += ",callsite symbol,dest symbol";
+    }
+    if (with_count) {
+        header += ",count";
+    }
+    if (with_profile) {
+        header += ",error,callsite executions";
+    }
+    if (with_branch_kinds) {
+        header += ",branch kind";
+    }
+    header += '\n';
+    return header;
+}
+
+static void append_hex(string &chunk, uint64_t value) {
+    char digits[sizeof("0x") + 16];
+    int len = snprintf(digits, sizeof(digits), "0x%lx", value);
+    chunk.append(digits, len);
+}
+
+void format_csv_row(string &chunk, const edge &e, string_view callsite_image,
+                    string_view dst_image, bool with_count, bool with_symbols,
+                    string_view callsite_symbol, string_view dst_symbol,
+                    string_view branch_kind, const profile_counts *profile) {
+    append_hex(chunk, e.callsite.offset);
+    chunk += ',';
+    append_hex(chunk, e.dst.offset);
+    chunk += ',';
+    append_hex(chunk, e.callsite_vaddr);
+    chunk += ',';
+    append_hex(chunk, e.dst_vaddr);
+    chunk += ',';
+    chunk += callsite_image;
+    chunk += ',';
+    chunk += dst_image;
+    if (with_symbols) {
+        chunk += ',';
+        chunk += callsite_symbol;
+        chunk += ',';
+        chunk += dst_symbol;
+    }
+    if (with_count) {
+        chunk += ',';
+        chunk += to_string(e.count);
+    }
+    if (profile) {
+        chunk += ',';
+        chunk += to_string(profile->error);
+        chunk += ',';
+        chunk += to_string(profile->callsite_executions);
+    }
+    if (!branch_kind.empty()) {
+        chunk += ',';
+        chunk += branch_kind;
+    }
+    chunk += '\n';
+}
+
+string branch_kind_name(ibresolver_branch_kind kind) {
+    string name;
+    switch (kind & IBRESOLVER_BRANCH_KIND_MASK) {
+        case IBRESOLVER_BRANCH_CALL:
+            name = "call";
+            break;
+        case IBRESOLVER_BRANCH_JUMP:
+            name = "jump";
+            break;
+        case IBRESOLVER_BRANCH_RETURN:
+            name = "return";
+            break;
+        default:
+            name = "unknown";
+            break;
+    }
+    if (kind & IBRESOLVER_BRANCH_CONDITIONAL) {
+        name += "+conditional";
+    }
+    if (kind & IBRESOLVER_BRANCH_MODE_SWITCH) {
+        name += "+mode_switch";
+    }
+    return name;
+}
+
+void csv_image_table::write(string &chunk, uint32_t image, uint64_t bias,
+                            string_view build_id, string_view name) {
+    if (image < written.size() && written[image]) {
+        return;
+    }
+    if (image >= written.size()) {
+        written.resize(image + 1);
+    }
+    written[image] = true;
+    chunk += "#image,";
+    chunk += to_string(image);
+    chunk += ',';
+    append_hex(chunk, bias);
+    chunk += ',';
+    chunk += build_id;
+    chunk += ',';
+    chunk += name;
+    chunk += '\n';
+}
+
+static void put_varint(string &chunk, uint64_t value) {
+    while (value >= 0x80) {
+        chunk += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    chunk += (char)value;
+}
+
+// Map signed deltas to unsigned values so small negative deltas also get short encodings
+static uint64_t zigzag(uint64_t delta) { return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63); }
+
+static uint64_t unzigzag(uint64_t value) { return (value >> 1) ^ -(value & 1); }
+
+static void put_u64(string &chunk, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        chunk += (char)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const char *data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)(uint8_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+string bin_header(bool with_count, bool with_profile, const sampling_config *sampling,
+                  const sampling_drops &dropped) {
+    string header(bin_magic, sizeof(bin_magic));
+    header += (char)bin_version;
+    header += (char)((with_count ? BIN_HAS_COUNT : 0) | (with_profile ? BIN_PROFILE : 0) |
+                     (sampling ? BIN_SAMPLED : 0));
+    // Reserved
+    header.append(2, '\0');
+    if (sampling) {
+        put_u64(header, sampling->period);
+        put_u64(header, sampling->first);
+        put_u64(header, sampling->budget);
+        put_u64(header, dropped.period);
+        put_u64(header, dropped.first);
+        put_u64(header, dropped.budget);
+    }
+    return header;
+}
+
+bin_encoder::bin_encoder(bool with_count, bool with_profile, image_info_fn image_name,
+                         image_info_fn image_build_id)
+    : with_count(with_count),
+      with_profile(with_profile),
+      image_name(image_name),
+      image_build_id(image_build_id),
+      prev_callsite_vaddr(0),
+      prev_callsite_bias(0),
+      prev_dst_bias(0) {}
+
+void bin_encoder::encode_image(string &chunk, uint32_t image, uint64_t bias) {
+    if (image < images_written.size() && images_written[image]) {
+        return;
+    }
+    if (image >= images_written.size()) {
+        images_written.resize(image + 1);
+    }
+    images_written[image] = true;
+    const string &name = image_name(image);
+    const string &build_id = image_build_id(image);
+    chunk += (char)BIN_IMAGE;
+    put_varint(chunk, image);
+    put_varint(chunk, bias);
+    put_varint(chunk, build_id.size() / 2);
+    for (size_t i = 0; i + 1 < build_id.size(); i += 2) {
+        chunk += (char)stoul(build_id.substr(i, 2), NULL, 16);
+    }
+    put_varint(chunk, name.size());
+    chunk += name;
+}
+
+void bin_encoder::encode(string &chunk, const edge &e, const profile_counts *profile) {
+    uint64_t callsite_bias = e.callsite_vaddr - e.callsite.offset;
+    uint64_t dst_bias = e.dst_vaddr - e.dst.offset;
+    encode_image(chunk, e.callsite.image, callsite_bias);
+    encode_image(chunk, e.dst.image, dst_bias);
+
+    chunk += (char)BIN_EDGE;
+    put_varint(chunk, zigzag(e.callsite_vaddr - prev_callsite_vaddr));
+    put_varint(chunk, zigzag(e.dst_vaddr - e.callsite_vaddr));
+    put_varint(chunk, zigzag(callsite_bias - prev_callsite_bias));
+    put_varint(chunk, zigzag(dst_bias - prev_dst_bias));
+    put_varint(chunk, e.callsite.image);
+    put_varint(chunk, e.dst.image);
+    if (with_count) {
+        put_varint(chunk, e.count);
+    }
+    if (with_profile) {
+        put_varint(chunk, profile->error);
+        put_varint(chunk, profile->callsite_executions);
+    }
+    prev_callsite_vaddr = e.callsite_vaddr;
+    prev_callsite_bias = callsite_bias;
+    prev_dst_bias = dst_bias;
+}
+
+bin_decoder::bin_decoder(string_view data)
+    : data(data),
+      pos(bin_header_size),
+      header_ok(false),
+      has_count(false),
+      has_profile(false),
+      has_sampling(false),
+      sampling_policies({}),
+      sampling_dropped({}),
+      version(0),
+      prev_callsite_vaddr(0),
+      prev_callsite_bias(0),
+      prev_dst_bias(0) {
+    if ((data.size() < bin_header_size) || memcmp(data.data(), bin_magic, sizeof(bin_magic)) ||
+        ((uint8_t)data[4] == 0) || ((uint8_t)data[4] > bin_version)) {
+        pos = 0;
+        return;
+    }
+    version = data[4];
+    has_count = data[5] & BIN_HAS_COUNT;
+    has_profile = data[5] & BIN_PROFILE;
+    has_sampling = data[5] & BIN_SAMPLED;
+    if (has_sampling) {
+        if (data.size() < bin_header_size + bin_sampling_size) {
+            pos = 0;
+            return;
+        }
+        const char *block = data.data() + bin_header_size;
+        sampling_policies = {.period = get_u64(block), .first = get_u64(block + 8),
+                             .budget = get_u64(block + 16)};
+        sampling_dropped = {.period = get_u64(block + 24), .first = get_u64(block + 32),
+                            .budget = get_u64(block + 40)};
+        pos += bin_sampling_size;
+    }
+    header_ok = true;
+}
+
+bool bin_decoder::read_varint(uint64_t &value) {
+    value = 0;
+    for (int shift = 0; (shift < 64) && (pos < data.size()); shift += 7) {
+        uint8_t byte = data[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool bin_decoder::next(edge &e, profile_counts *profile) {
+    if (!header_ok) {
+        return false;
+    }
+    while (pos < data.size()) {
+        // Rewind to the start of the record if it turns out to be truncated
+        size_t record_start = pos;
+        uint8_t tag = data[pos++];
+        if (tag == BIN_IMAGE) {
+            uint64_t image, len;
+            image_info info = {.name = "", .build_id = "", .bias = 0};
+            if (!read_varint(image)) {
+                pos = record_start;
+                return false;
+            }
+            if (version >= 3) {
+                if (!read_varint(info.bias) || !read_varint(len) ||
+                    (len > data.size() - pos)) {
+                    pos = record_start;
+                    return false;
+                }
+                static const char digits[] = "0123456789abcdef";
+                for (uint64_t i = 0; i < len; i++) {
+                    uint8_t byte = data[pos++];
+                    info.build_id += digits[byte >> 4];
+                    info.build_id += digits[byte & 0xf];
+                }
+            }
+            if (!read_varint(len) || (len > data.size() - pos)) {
+                pos = record_start;
+                return false;
+            }
+            info.name = string(data.substr(pos, len));
+            pos += len;
+            if (image >= images.size()) {
+                images.resize(image + 1);
+            }
+            images[image] = info;
+        } else if (tag == BIN_EDGE) {
+            uint64_t callsite_delta, dst_delta, callsite_bias_delta, dst_bias_delta;
+            uint64_t callsite_image, dst_image;
+            uint64_t count = 1;
+            profile_counts counts = {.error = 0, .callsite_executions = 0};
+            if (!read_varint(callsite_delta) || !read_varint(dst_delta) ||
+                !read_varint(callsite_bias_delta) || !read_varint(dst_bias_delta) ||
+                !read_varint(callsite_image) || !read_varint(dst_image) ||
+                (has_count && !read_varint(count)) ||
+                (has_profile &&
+                 (!read_varint(counts.error) || !read_varint(counts.callsite_executions))) ||
+                (callsite_image >= images.size()) || (dst_image >= images.size())) {
+                pos = record_start;
+                return false;
+            }
+            e.callsite_vaddr = prev_callsite_vaddr + unzigzag(callsite_delta);
+            e.dst_vaddr = e.callsite_vaddr + unzigzag(dst_delta);
+            uint64_t callsite_bias = prev_callsite_bias + unzigzag(callsite_bias_delta);
+            uint64_t dst_bias = prev_dst_bias + unzigzag(dst_bias_delta);
+            e.callsite.offset = e.callsite_vaddr - callsite_bias;
+            e.callsite.image = callsite_image;
+            e.dst.offset = e.dst_vaddr - dst_bias;
+            e.dst.image = dst_image;
+            e.count = count;
+            e.resolved = true;
+            e.kind = IBRESOLVER_BRANCH_UNKNOWN;
+            if (profile) {
+                *profile = counts;
+            }
+            prev_callsite_vaddr = e.callsite_vaddr;
+            prev_callsite_bias = callsite_bias;
+            prev_dst_bias = dst_bias;
+            return true;
+        } else {
+            pos = record_start;
+            return false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,181 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "builtin_backend.h"
+#include "edge_table.h"
+#include "sampler.h"
+
+// The error bound of a count in a value profile and the number of times its callsite was executed
+// (see value_profile.h). The edge was taken between `count - error` and `count` times.
+typedef struct profile_counts {
+    uint64_t error;
+    uint64_t callsite_executions;
+} profile_counts;
+
+// The csv header line including the trailing newline. If `sampling` is not NULL it's preceded by a
+// comment line with the sampling policies and the number of edges each one dropped. The counts are
+// zero-padded so the header keeps the same size when it's rewritten with the final counts at exit.
+// With `with_image_ids` the image columns hold IDs from the `#image` lines instead of paths. With
+// `with_profile` the count is followed by the `error` and `callsite executions` columns.
+std::string csv_header(bool with_count, bool with_symbols, bool with_image_ids,
+                       bool with_branch_kinds, bool with_profile,
+                       const sampling_config *sampling = NULL, const sampling_drops &dropped = {});
+
+// Append an edge as a line of the output csv. The symbols are only written if `with_symbols` is set,
+// the profile columns follow the count if `profile` is not NULL and the branch kind (see
+// `branch_kind_name`) is the last column if it's not empty.
+void format_csv_row(std::string &chunk, const edge &e, std::string_view callsite_image,
+                    std::string_view dst_image, bool with_count, bool with_symbols = false,
+                    std::string_view callsite_symbol = {}, std::string_view dst_symbol = {},
+                    std::string_view branch_kind = {}, const profile_counts *profile = NULL);
+
+// The name of a branch kind in the csv output, e.g. `call`, `jump`, `return` or `unknown` followed
+// by `+conditional` and `+mode_switch` if those flags are set
+std::string branch_kind_name(ibresolver_branch_kind kind);
+
+// Writes each image once as a comment line for csv output where rows refer to images by ID
+//
+//     #image,ID,bias,build ID,path
+//
+// The line precedes the first row that refers to its ID. The bias is the vaddr of the first row
+// using the image minus its offset, i.e. the bias of the segment containing that row. Segments of
+// one ELF may be loaded with different biases (e.g. x86-64/fn_ptr-offset-text.elf) so it isn't
+// necessarily the load base of the file. The build ID is empty if the image doesn't have one.
+class csv_image_table {
+   public:
+    // Append the line for `image` to the output chunk if it wasn't written yet
+    void write(std::string &chunk, uint32_t image, uint64_t bias, std::string_view build_id,
+               std::string_view name);
+
+   private:
+    std::vector<bool> written;
+};
+
+// The binary output format is a little-endian, record-oriented stream. The file starts with an
+// 8-byte header
+//
+//     "IBRB" | version (u8) | flags (u8) | reserved (u16)
+//
+// followed by a sequence of records which each start with a one byte tag. Integers in records are
+// LEB128 varints and signed values are zigzag encoded.
+//
+//     IMAGE: tag | image ID | bias | build ID length | build ID | name length | name
+//     EDGE:  tag | callsite vaddr delta | dest vaddr - callsite vaddr | callsite bias delta |
+//            dest bias delta | callsite image ID | dest image ID | [count] |
+//            [error | callsite executions]
+//
+// If the `BIN_SAMPLED` flag is set the header is followed by six u64s: the sampling period, first
+// and budget (see sampler.h) and the number of edges dropped by each of them.
+//
+// The image table is written incrementally: an IMAGE record always precedes the first EDGE record
+// that refers to its ID. The bias and build ID are the same as in `csv_image_table` and the build
+// ID is stored as raw bytes rather than hex. Version 2 files don't have either. The callsite vaddr
+// delta is relative to the previous edge's callsite vaddr and a bias is the difference between a
+// vaddr and its ELF file offset, relative to the previous edge's bias. The count is only present
+// if the `BIN_HAS_COUNT` flag is set and the error and callsite executions of a value profile (see
+// `profile_counts`) only if the `BIN_PROFILE` flag is set, which version 3 files don't have.
+static const char bin_magic[4] = {'I', 'B', 'R', 'B'};
+static const uint8_t bin_version = 4;
+static const size_t bin_header_size = 8;
+static const size_t bin_sampling_size = 6 * sizeof(uint64_t);
+
+static const uint8_t BIN_HAS_COUNT = 1 << 0;
+static const uint8_t BIN_SAMPLED = 1 << 1;
+static const uint8_t BIN_PROFILE = 1 << 2;
+
+static const uint8_t BIN_IMAGE = 1;
+static const uint8_t BIN_EDGE = 2;
+
+// The binary file header. Like `csv_header` it has the same size regardless of the drop counts.
+std::string bin_header(bool with_count, bool with_profile, const sampling_config *sampling = NULL,
+                       const sampling_drops &dropped = {});
+
+// Gets the name or build ID of an image from its ID
+typedef const std::string &(*image_info_fn)(uint32_t);
+
+// Encodes edges into binary records. The encoder remembers which images were already written and
+// the previous edge so one encoder must be used for the whole file.
+class bin_encoder {
+   public:
+    bin_encoder(bool with_count, bool with_profile, image_info_fn image_name,
+                image_info_fn image_build_id);
+
+    // Append an edge (and IMAGE records for images not written yet) to the output chunk. `profile`
+    // must be set if the encoder was created `with_profile`.
+    void encode(std::string &chunk, const edge &e, const profile_counts *profile = NULL);
+
+   private:
+    void encode_image(std::string &chunk, uint32_t image, uint64_t bias);
+
+    bool with_count;
+    bool with_profile;
+    image_info_fn image_name;
+    image_info_fn image_build_id;
+    std::vector<bool> images_written;
+    uint64_t prev_callsite_vaddr;
+    uint64_t prev_callsite_bias;
+    uint64_t prev_dst_bias;
+};
+
+// Decodes a binary output file
+class bin_decoder {
+   public:
+    // `data` must start with the file header and outlive the decoder
+    explicit bin_decoder(std::string_view data);
+
+    // Checks if the header is valid and has a supported version
+    bool valid_header() const { return header_ok; }
+    bool with_count() const { return has_count; }
+    bool with_profile() const { return has_profile; }
+    // The sampling policies the file was written with or NULL if every edge was recorded
+    const sampling_config *sampling() const { return has_sampling ? &sampling_policies : NULL; }
+    const sampling_drops &dropped() const { return sampling_dropped; }
+
+    // Decode the next edge, reading any IMAGE records before it. The profile counts are also stored
+    // in `profile` if it's not NULL. Returns false at the end of the data or if the remaining data
+    // is truncated or malformed (see `truncated`).
+    bool next(edge &e, profile_counts *profile = NULL);
+
+    // Checks if decoding stopped before the end of the data (e.g. the guest was killed in the
+    // middle of writing a record)
+    bool truncated() const { return pos != data.size(); }
+
+    // Get the name of an image from its ID
+    const std::string &image_name(uint32_t image) const { return images[image].name; }
+    // Get the build ID of an image as a hex string. Empty if it doesn't have one or the file is
+    // version 2.
+    const std::string &image_build_id(uint32_t image) const { return images[image].build_id; }
+    // Get the bias of an image (see `csv_image_table`). Zero if the file is version 2.
+    uint64_t image_bias(uint32_t image) const { return images[image].bias; }
+
+   private:
+    typedef struct image_info {
+        std::string name;
+        std::string build_id;
+        uint64_t bias;
+    } image_info;
+
+    bool read_varint(uint64_t &value);
+
+    std::string_view data;
+    size_t pos;
+    bool header_ok;
+    bool has_count;
+    bool has_profile;
+    bool has_sampling;
+    sampling_config sampling_policies;
+    sampling_drops sampling_dropped;
+    uint8_t version;
+    std::vector<image_info> images;
+    uint64_t prev_callsite_vaddr;
+    uint64_t prev_callsite_bias;
+    uint64_t prev_dst_bias;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include <fnmatch.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "image_filter.h"
+#include "maps.h"
+
+using namespace std;
+
+static vector<string> includes;
+static vector<string> excludes;
+
+// Whether each image in the image table is selected, computed the first time it's needed
+static vector<optional<bool>> selected;
+// Translations are serialized by QEMU in user-mode so this is uncontended
+static mutex filter_lock;
+
+static const char main_pattern[] = "main";
+
+// Options of QEMU's user-mode emulators which take an argument
+static const char *const qemu_options_with_args[] = {
+    "g", "L", "s", "cpu", "E", "U", "0", "r", "d", "dfilter", "D", "p", "seed", "trace", "plugin",
+    "B", "R",
+};
+
+// Find the guest's main executable on QEMU's command line. The plugin API doesn't expose it so
+// this skips QEMU's options and their arguments to find the first argument, which is the guest
+// program. Returns an empty string if it can't be found.
+static string find_main_executable() {
+    ifstream file("/proc/self/cmdline");
+    string cmdline((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    vector<string> args;
+    for (size_t start = 0; start < cmdline.size();) {
+        size_t end = cmdline.find('\0', start);
+        if (end == string::npos) {
+            end = cmdline.size();
+        }
+        args.push_back(cmdline.substr(start, end - start));
+        start = end + 1;
+    }
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i][0] != '-') {
+            char *path = realpath(args[i].c_str(), NULL);
+            string main = path ? path : "";
+            free(path);
+            return main;
+        }
+        // Options may start with one or two dashes
+        const char *option = args[i].c_str() + ((args[i][1] == '-') ? 2 : 1);
+        for (const char *with_arg : qemu_options_with_args) {
+            if (!strcmp(option, with_arg)) {
+                i++;
+                break;
+            }
+        }
+    }
+    return "";
+}
+
+static bool matches_any(const vector<string> &patterns, const string &path) {
+    static const string main = find_main_executable();
+    for (const string &pattern : patterns) {
+        if (pattern == main_pattern) {
+            if (!main.empty() && (path == main)) {
+                return true;
+            }
+        } else if (!fnmatch(pattern.c_str(), path.c_str(), 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void image_filter_include(const char *pattern) { includes.push_back(pattern); }
+
+void image_filter_exclude(const char *pattern) { excludes.push_back(pattern); }
+
+bool image_filter_enabled() { return !includes.empty() || !excludes.empty(); }
+
+bool image_selected(uint32_t image) {
+    lock_guard<mutex> guard(filter_lock);
+    if (image >= selected.size()) {
+        selected.resize(image + 1);
+    }
+    if (!selected[image].has_value()) {
+        const string &path = image_name(image);
+        selected[image] = (includes.empty() || matches_any(includes, path)) &&
+                          !matches_any(excludes, path);
+    }
+    return selected[image].value();
+}
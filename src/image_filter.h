@@ -0,0 +1,19 @@
+#ifndef IMAGE_FILTER_H
+#define IMAGE_FILTER_H
+
+#include <cstdint>
+
+// Selects the images whose indirect branches are recorded. An image is selected if it matches any
+// `include` pattern (or there are none) and no `exclude` pattern. Patterns are globs matched
+// against the whole path with fnmatch(3), or `main` for the guest's main executable.
+
+void image_filter_include(const char *pattern);
+void image_filter_exclude(const char *pattern);
+
+// Whether any patterns were added
+bool image_filter_enabled();
+
+// Checks if an image is selected. The result is computed once per image.
+bool image_selected(uint32_t image);
+
+#endif
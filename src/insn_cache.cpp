@@ -0,0 +1,289 @@
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "arm_state.h"
+#include "insn_cache.h"
+#include "maps.h"
+
+using namespace std;
+
+// The raw bytes of an instruction. Longer instructions (none on x86-64 or arm) aren't cached.
+typedef struct insn_bytes {
+    uint8_t size;
+    uint8_t data[15];
+
+    bool operator==(const insn_bytes &other) const {
+        return (size == other.size) && !memcmp(data, other.data, size);
+    }
+} insn_bytes;
+
+// The key of the in-memory cache
+typedef struct cache_key {
+    insn_bytes bytes;
+    insn_set set;
+
+    bool operator==(const cache_key &other) const {
+        return (set == other.set) && (bytes == other.bytes);
+    }
+} cache_key;
+
+struct cache_key_hash {
+    size_t operator()(const cache_key &key) const {
+        // FNV-1a
+        uint64_t h = (0xcbf29ce484222325ULL ^ key.bytes.size ^ (key.set << 8));
+        for (int i = 0; i < key.bytes.size; i++) {
+            h = (h ^ key.bytes.data[i]) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+};
+
+// A classification saved in the cache file. The bytes are kept to detect code that was modified
+// at runtime.
+typedef struct saved_insn {
+    insn_bytes bytes;
+    ibresolver_branch_kind kind;
+} saved_insn;
+
+// Saved classifications of the instructions in one image keyed by file offset
+typedef unordered_map<uint64_t, saved_insn> saved_image;
+
+static const char cache_file_magic[] = "ibresolver instruction cache 2";
+
+// Flushing more entries than this clears the in-memory cache to bound its size
+static const size_t max_entries = 1 << 20;
+
+// Classifications of instructions translated during this run keyed by the instruction bytes and
+// instruction set. Since the key is the content of the instruction rather than its address the
+// entries are still valid after QEMU flushes its translations or the guest modifies its code. This
+// assumes the backend's classification only depends on the bytes once the instruction set is known.
+// Whether an ARM instruction is conditional is part of its bytes while a THUMB one may be made
+// conditional by an earlier IT instruction, so backends mark every THUMB branch as conditional.
+static unordered_map<cache_key, ibresolver_branch_kind, cache_key_hash> cache;
+
+// Whether classifications are persisted to `cache_path`
+static bool persistent = false;
+static string cache_path;
+static string cache_arch;
+static string cache_backend;
+// Saved classifications keyed by image path and build ID
+static unordered_map<string, saved_image> saved;
+// Saved classifications for each image ID in the image table, looked up the first time they're
+// needed
+static vector<saved_image *> image_saved;
+// The vaddrs of the instructions whose classification was saved since the memory map last changed.
+// Cache hits for the same instruction then don't need to look up its image offset again.
+static unordered_set<uint64_t> saved_vaddrs;
+
+// Guards all of the above. Translations are serialized by QEMU in user-mode so this is uncontended.
+static mutex cache_lock;
+
+// Fails if the instruction is too long or its instruction set isn't known
+static bool to_insn_bytes(const uint8_t *insn_data, size_t insn_size, insn_set set,
+                          insn_bytes &insn) {
+    if ((insn_size > sizeof(insn.data)) || (set == UNKNOWN_INSN_SET)) {
+        return false;
+    }
+    insn.size = insn_size;
+    memcpy(insn.data, insn_data, insn_size);
+    return true;
+}
+
+static string image_key(const string &path, const string &build_id) {
+    return build_id + '\t' + path;
+}
+
+// Must be called with `cache_lock` held
+static saved_image &saved_for_image(uint32_t image) {
+    if (image >= image_saved.size()) {
+        image_saved.resize(image + 1, NULL);
+    }
+    if (!image_saved[image]) {
+        image_saved[image] = &saved[image_key(image_name(image), image_build_id(image))];
+    }
+    return *image_saved[image];
+}
+
+static bool load(const char *path) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        // Nothing to load on the first run
+        return errno == ENOENT;
+    }
+    string magic, arch, backend;
+    getline(file, magic);
+    getline(file, arch);
+    getline(file, backend);
+    if ((magic != cache_file_magic) || (arch != cache_arch) || (backend != cache_backend)) {
+        cout << "WARNING: Ignoring instruction cache " << path
+             << " since it was made by a different version, architecture or backend" << endl;
+        return true;
+    }
+    // Each line is `build ID (or "-")\toffset\tbytes\tbranch kind\tpath`
+    string line;
+    while (getline(file, line)) {
+        istringstream fields(line);
+        string build_id, offset, bytes, kind, image;
+        if (!getline(fields, build_id, '\t') || !getline(fields, offset, '\t') ||
+            !getline(fields, bytes, '\t') || !getline(fields, kind, '\t') ||
+            !getline(fields, image)) {
+            continue;
+        }
+        saved_insn insn = {};
+        if ((bytes.size() % 2) || (bytes.size() / 2 > sizeof(insn.bytes.data))) {
+            continue;
+        }
+        insn.bytes.size = bytes.size() / 2;
+        for (size_t i = 0; i < insn.bytes.size; i++) {
+            insn.bytes.data[i] = stoul(bytes.substr(2 * i, 2), NULL, 16);
+        }
+        insn.kind = stoul(kind);
+        if (build_id == "-") {
+            build_id = "";
+        }
+        saved[image_key(image, build_id)][stoull(offset, NULL, 16)] = insn;
+    }
+    return true;
+}
+
+bool insn_cache_init(const char *arch, const char *backend, const char *path) {
+    cache_arch = arch;
+    cache_backend = backend;
+    if (!path) {
+        return true;
+    }
+    persistent = true;
+    cache_path = path;
+    return load(path);
+}
+
+insn_set insn_cache_block_set(const ibresolver_insn *insns, size_t num_insns) {
+    if (cache_arch != "arm") {
+        return DEFAULT_INSN_SET;
+    }
+    switch (infer_arm_state(insns, num_insns)) {
+        case ARM_STATE:
+            return ARM_INSN_SET;
+        case THUMB_STATE:
+            return THUMB_INSN_SET;
+        default:
+            return UNKNOWN_INSN_SET;
+    }
+}
+
+// Remember the classification of the instruction at `vaddr` for later runs. Must be called with
+// `cache_lock` held.
+static void save_classification(uint64_t vaddr, const insn_bytes &insn,
+                                ibresolver_branch_kind kind) {
+    saved_vaddrs.insert(vaddr);
+    optional<image_offset> offset = guest_vaddr_to_offset(vaddr);
+    // Code in anonymous mappings (e.g. JITed code) can't be found again in a later run
+    if (!offset.has_value() || (image_name(offset->image)[0] != '/')) {
+        return;
+    }
+    saved_for_image(offset->image)[offset->offset] = {.bytes = insn, .kind = kind};
+}
+
+optional<ibresolver_branch_kind> insn_cache_lookup(uint64_t vaddr, const uint8_t *insn_data,
+                                                   size_t insn_size, insn_set set) {
+    insn_bytes insn;
+    if (!to_insn_bytes(insn_data, insn_size, set, insn)) {
+        return {};
+    }
+    lock_guard<mutex> guard(cache_lock);
+    auto it = cache.find({insn, set});
+    if (it != cache.end()) {
+        // The same bytes may be at a different offset in a later run so save this address too. Hot
+        // instructions are translated many times so each address is only looked up once.
+        if (persistent && !saved_vaddrs.count(vaddr)) {
+            save_classification(vaddr, insn, it->second);
+        }
+        return it->second;
+    }
+    if (!persistent) {
+        return {};
+    }
+    optional<image_offset> offset = guest_vaddr_to_offset(vaddr);
+    if (!offset.has_value()) {
+        return {};
+    }
+    saved_image &image = saved_for_image(offset->image);
+    auto saved_it = image.find(offset->offset);
+    if ((saved_it == image.end()) || !(saved_it->second.bytes == insn)) {
+        return {};
+    }
+    cache.emplace(cache_key{insn, set}, saved_it->second.kind);
+    return saved_it->second.kind;
+}
+
+void insn_cache_insert(uint64_t vaddr, const uint8_t *insn_data, size_t insn_size, insn_set set,
+                       ibresolver_branch_kind kind) {
+    insn_bytes insn;
+    if (!to_insn_bytes(insn_data, insn_size, set, insn)) {
+        return;
+    }
+    lock_guard<mutex> guard(cache_lock);
+    cache.emplace(cache_key{insn, set}, kind);
+    if (persistent) {
+        save_classification(vaddr, insn, kind);
+    }
+}
+
+void insn_cache_flush() {
+    lock_guard<mutex> guard(cache_lock);
+    if (cache.size() > max_entries) {
+        cache.clear();
+    }
+    if (saved_vaddrs.size() > max_entries) {
+        saved_vaddrs.clear();
+    }
+}
+
+void insn_cache_maps_changed() {
+    lock_guard<mutex> guard(cache_lock);
+    saved_vaddrs.clear();
+}
+
+void insn_cache_save() {
+    if (!persistent) {
+        return;
+    }
+    lock_guard<mutex> guard(cache_lock);
+    // Write to a temporary file and rename it so concurrent runs never see a partial cache file
+    string tmp_path = cache_path + ".tmp." + to_string(getpid());
+    ofstream file(tmp_path);
+    if (file.fail()) {
+        cout << "ERROR: Could not write instruction cache " << tmp_path << endl;
+        return;
+    }
+    file << cache_file_magic << "\n" << cache_arch << "\n" << cache_backend << "\n";
+    for (const auto &[key, image] : saved) {
+        size_t tab = key.find('\t');
+        string build_id = key.substr(0, tab);
+        string path = key.substr(tab + 1);
+        for (const auto &[offset, insn] : image) {
+            char hex_bytes[2 * sizeof(insn.bytes.data) + 1] = "";
+            for (int i = 0; i < insn.bytes.size; i++) {
+                snprintf(hex_bytes + 2 * i, 3, "%02x", insn.bytes.data[i]);
+            }
+            file << (build_id.empty() ? "-" : build_id) << "\t" << hex << offset << "\t"
+                 << hex_bytes << "\t" << dec << (unsigned)insn.kind << "\t" << path << "\n";
+        }
+    }
+    file.close();
+    if (file.fail() || rename(tmp_path.c_str(), cache_path.c_str())) {
+        cout << "ERROR: Could not write instruction cache " << cache_path << endl;
+        remove(tmp_path.c_str());
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef INSN_CACHE_H
+#define INSN_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "builtin_backend.h"
+
+// Set up the cache of instruction classifications. If `path` is not NULL classifications are also
+// loaded from that file and saved back to it by `insn_cache_save`. Saved classifications are only
+// used if they were made for the same `arch` and `backend`. Returns false if `path` exists but
+// can't be read.
+bool insn_cache_init(const char *arch, const char *backend, const char *path);
+
+// The instruction set of a block as far as it can be told from the block itself. On arm the same 4
+// bytes may be an ARM instruction or a 32-bit THUMB one, so classifications are cached separately
+// for each instruction set and not at all when it's unknown.
+typedef enum insn_set {
+    // Architectures with a single instruction set
+    DEFAULT_INSN_SET,
+    ARM_INSN_SET,
+    THUMB_INSN_SET,
+    UNKNOWN_INSN_SET,
+} insn_set;
+
+// Infer the instruction set of a block the same way the simple backend does (see `infer_arm_state`)
+insn_set insn_cache_block_set(const ibresolver_insn *insns, size_t num_insns);
+
+// Get the cached branch kind of an instruction in a block using `set`, if any
+std::optional<ibresolver_branch_kind> insn_cache_lookup(uint64_t vaddr, const uint8_t *insn_data,
+                                                        size_t insn_size, insn_set set);
+
+// Cache the branch kind the backend classified an instruction in a block using `set` as
+void insn_cache_insert(uint64_t vaddr, const uint8_t *insn_data, size_t insn_size, insn_set set,
+                       ibresolver_branch_kind kind);
+
+// Called when QEMU flushes its translated blocks
+void insn_cache_flush();
+
+// Called when the memory map of the guest may have changed so instructions at vaddrs that were
+// already saved are looked up in the new map
+void insn_cache_maps_changed();
+
+// Write the classifications to the file passed to `insn_cache_init`, if any
+void insn_cache_save();
+
+#endif
@@ -0,0 +1,198 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "known_edges.h"
+#include "maps.h"
+
+using namespace std;
+
+typedef struct known_edge {
+    uint64_t image_key;
+    uint64_t callsite_offset;
+    uint64_t dst_offset;
+
+    bool operator<(const known_edge &other) const {
+        if (image_key != other.image_key) {
+            return image_key < other.image_key;
+        }
+        if (callsite_offset != other.callsite_offset) {
+            return callsite_offset < other.callsite_offset;
+        }
+        return dst_offset < other.dst_offset;
+    }
+} known_edge;
+
+typedef struct known_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+} known_header;
+
+static const char known_magic[8] = {'I', 'B', 'R', 'K', 'N', 'O', 'W', 'N'};
+static const uint32_t known_version = 1;
+
+static bool enabled = false;
+static string db_path;
+
+// The mapping of the database file. `records` points into it and is empty if there's no database
+// yet. The file is never unmapped.
+static void *db_map = NULL;
+static size_t db_size = 0;
+static const known_edge *records = NULL;
+static size_t num_records = 0;
+
+// Keys of the images in the image table, computed the first time they're needed. Anonymous
+// mappings have no key.
+static vector<optional<optional<uint64_t>>> image_keys;
+static shared_mutex keys_lock;
+
+// Edges written by this run which weren't in the database
+static set<known_edge> added;
+static mutex added_lock;
+
+static uint64_t hash_string(const string &s) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : s) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static optional<uint64_t> image_key(uint32_t image) {
+    {
+        shared_lock<shared_mutex> guard(keys_lock);
+        if ((image < image_keys.size()) && image_keys[image].has_value()) {
+            return image_keys[image].value();
+        }
+    }
+    const string &path = image_name(image);
+    optional<uint64_t> key;
+    if (path[0] == '/') {
+        const string &build_id = image_build_id(image);
+        key = hash_string(build_id.empty() ? path : build_id);
+    }
+    unique_lock<shared_mutex> guard(keys_lock);
+    if (image >= image_keys.size()) {
+        image_keys.resize(image + 1);
+    }
+    image_keys[image] = key;
+    return key;
+}
+
+// Get the record for a resolved edge. Returns false if the edge can't be saved since one of its
+// ends is in an anonymous mapping.
+static bool to_known_edge(const edge &e, known_edge &k) {
+    optional<uint64_t> callsite_key = image_key(e.callsite.image);
+    optional<uint64_t> dst_key = image_key(e.dst.image);
+    if (!callsite_key.has_value() || !dst_key.has_value()) {
+        return false;
+    }
+    k = {
+        // Combine the keys so calls into different libraries at the same offset are different
+        .image_key = (callsite_key.value() * 0x9e3779b97f4a7c15ULL) ^ dst_key.value(),
+        .callsite_offset = e.callsite.offset,
+        .dst_offset = e.dst.offset,
+    };
+    return true;
+}
+
+bool known_edges_init(const char *path) {
+    enabled = true;
+    db_path = path;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Nothing to load on the first run
+        return errno == ENOENT;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        db_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if ((st.st_size > 0) && (db_map == MAP_FAILED)) {
+        db_map = NULL;
+        return false;
+    }
+    db_size = st.st_size;
+
+    known_header header = {};
+    if (db_size >= sizeof(header)) {
+        memcpy(&header, db_map, sizeof(header));
+    }
+    if (memcmp(header.magic, known_magic, sizeof(known_magic)) ||
+        (header.version != known_version) ||
+        (header.count > (db_size - sizeof(header)) / sizeof(known_edge))) {
+        cout << "WARNING: Ignoring known edge database " << path
+             << " since it was made by a different version or is truncated" << endl;
+        return true;
+    }
+    records = (const known_edge *)((const uint8_t *)db_map + sizeof(header));
+    num_records = header.count;
+    return true;
+}
+
+bool known_edges_enabled() { return enabled; }
+
+bool known_edges_contains(const edge &e) {
+    known_edge k;
+    if (!num_records || !to_known_edge(e, k)) {
+        return false;
+    }
+    return binary_search(records, records + num_records, k);
+}
+
+void known_edges_add(const edge &e) {
+    known_edge k;
+    if (!to_known_edge(e, k) || binary_search(records, records + num_records, k)) {
+        return;
+    }
+    lock_guard<mutex> guard(added_lock);
+    added.insert(k);
+}
+
+long known_edges_save() {
+    lock_guard<mutex> guard(added_lock);
+    vector<known_edge> merged(num_records + added.size());
+    merge(records, records + num_records, added.begin(), added.end(), merged.begin());
+
+    // Write to a temporary file and rename it so concurrent runs never see a partial database. The
+    // old file stays mapped since vCPUs may still be looking up edges.
+    string tmp_path = db_path + ".tmp." + to_string(getpid());
+    ofstream file(tmp_path, ios::binary);
+    if (file.fail()) {
+        cout << "ERROR: Could not write known edge database " << tmp_path << endl;
+        return -1;
+    }
+    known_header header = {.version = known_version, .reserved = 0, .count = merged.size()};
+    memcpy(header.magic, known_magic, sizeof(known_magic));
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)merged.data(), merged.size() * sizeof(known_edge));
+    file.close();
+    if (file.fail() || rename(tmp_path.c_str(), db_path.c_str())) {
+        cout << "ERROR: Could not write known edge database " << db_path << endl;
+        remove(tmp_path.c_str());
+        return -1;
+    }
+    return added.size();
+}
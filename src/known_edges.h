@@ -0,0 +1,42 @@
+#ifndef KNOWN_EDGES_H
+#define KNOWN_EDGES_H
+
+#include <cstddef>
+
+#include "edge_table.h"
+
+// A database of edges found by previous runs, used by the `known` argument so that a run only
+// writes the edges that are new. The file is a header followed by a sorted array of records, all
+// in the host's byte order
+//
+//   char magic[8]     "IBRKNOWN"
+//   uint32_t version  1
+//   uint32_t reserved 0
+//   uint64_t count    number of records
+//
+// Each record is three uint64_t's: the image key, the callsite offset and the destination offset.
+// Records are sorted by all three fields. The image key combines the FNV-1a hashes of the callsite
+// and destination images' GNU build IDs, or of their paths if they don't have one, so edges are
+// still recognized if an image is moved.
+// Edges in anonymous mappings (e.g. JITed code) are never considered known.
+
+// Map the database at `path`. Returns false if `path` exists but can't be read. A file that isn't
+// a database is ignored with a warning so the next `known_edges_save` replaces it.
+bool known_edges_init(const char *path);
+
+// Whether `known_edges_init` was called
+bool known_edges_enabled();
+
+// Checks if a resolved edge was found by a previous run. This doesn't take any exclusive locks so
+// it can be called from the vCPU's execution callbacks.
+bool known_edges_contains(const edge &e);
+
+// Remember a resolved edge that's written to the output so it's known to later runs. This must
+// only be called by the writer thread or at exit.
+void known_edges_add(const edge &e);
+
+// Write the previously known edges and the ones added by this run back to the database. Returns
+// the number of edges added, or -1 if the database couldn't be written.
+long known_edges_save();
+
+#endif
@@ -0,0 +1,177 @@
+extern "C" {
+#include <qemu/qemu-plugin.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "elf_file.h"
+#include "maps.h"
+#include "stats.h"
+
+using namespace std;
+
+// A loaded segment described by a line in /proc/self/maps
+typedef struct mapping {
+    uint64_t start;
+    uint64_t end;
+    // The offset into the file the segment was loaded from
+    uint64_t file_load_offset;
+    uint32_t image;
+} mapping;
+
+// Mappings sorted by start address. Entries don't overlap so they're also sorted by end address.
+static vector<mapping> mappings;
+// Interned image names. This is a deque so references returned by `image_name` stay valid as new
+// images are added.
+static deque<string> images;
+static unordered_map<string, uint32_t> image_ids;
+// Build IDs of the interned images, read the first time they're requested
+static deque<optional<string>> build_ids;
+// Guards `mappings`, `images`, `image_ids` and `build_ids`
+static shared_mutex maps_lock;
+// Set when a syscall that may change the memory map returns
+static atomic<bool> maps_stale(true);
+
+// Syscalls which may change the memory map. Empty if every syscall should invalidate the cache.
+static vector<int64_t> maps_syscalls;
+
+void maps_init(const char *target_name) {
+    if (!strcmp(target_name, "x86_64")) {
+        // mmap, mprotect, munmap, brk, mremap, shmat, shmdt
+        maps_syscalls = {9, 10, 11, 12, 25, 30, 67};
+    } else if (!strcmp(target_name, "arm")) {
+        // brk, munmap, mprotect, mremap, mmap2, shmat, shmdt
+        maps_syscalls = {45, 91, 125, 163, 192, 305, 306};
+    }
+}
+
+bool syscall_changes_maps(int64_t num) {
+    if (maps_syscalls.empty()) {
+        return true;
+    }
+    return find(maps_syscalls.begin(), maps_syscalls.end(), num) != maps_syscalls.end();
+}
+
+void invalidate_maps() { maps_stale.store(true, memory_order_release); }
+
+// Must be called with `maps_lock` held exclusively
+static uint32_t intern_image(const char *name) {
+    auto it = image_ids.find(name);
+    if (it != image_ids.end()) {
+        return it->second;
+    }
+    uint32_t id = images.size();
+    images.emplace_back(name);
+    build_ids.emplace_back();
+    image_ids.emplace(images.back(), id);
+    return id;
+}
+
+// Re-parse /proc/self/maps into the sorted `mappings` index
+static void parse_maps() {
+    unique_lock<shared_mutex> guard(maps_lock);
+    // Clear the flag before reading the file so that an invalidation racing with the parse is not
+    // lost
+    maps_stale.store(false, memory_order_release);
+    mappings.clear();
+
+    ifstream maps("/proc/self/maps");
+    string line;
+    // For each entry in /proc/self/maps
+    while (getline(maps, line)) {
+        int name_pos = 0;
+        mapping m;
+        // Parse the /proc/self/maps line. Stores the start and end vaddrs of the loaded segment,
+        // the offset into the file the segment was loaded from and the number of characters in
+        // the maps string before the name of the ELF file (`name_pos`).
+        if (sscanf(line.c_str(), "%lx-%lx %*c%*c%*c%*c %lx %*x:%*x %*u %n", &m.start, &m.end,
+                   &m.file_load_offset, &name_pos) < 3) {
+            continue;
+        }
+        m.image = intern_image(line.c_str() + name_pos);
+        mappings.push_back(m);
+    }
+    // The kernel already lists mappings in ascending order, but don't rely on it
+    sort(mappings.begin(), mappings.end(),
+         [](const mapping &a, const mapping &b) { return a.start < b.start; });
+}
+
+// Binary search the index for the segment containing `host_vaddr`
+static optional<image_offset> lookup(uint64_t host_vaddr) {
+    shared_lock<shared_mutex> guard(maps_lock);
+    // Find the first segment starting after the addr. The one before it is the only candidate.
+    auto it = upper_bound(mappings.begin(), mappings.end(), host_vaddr,
+                          [](uint64_t addr, const mapping &m) { return addr < m.start; });
+    if (it == mappings.begin()) {
+        return {};
+    }
+    --it;
+    if (host_vaddr >= it->end) {
+        return {};
+    }
+    // Get the address as an offset into the loaded segment then turn the segment offset into an
+    // offset into the file
+    struct image_offset offset = {
+        .offset = host_vaddr - it->start + it->file_load_offset,
+        .image = it->image,
+    };
+    return offset;
+}
+
+optional<image_offset> guest_vaddr_to_offset(uint64_t guest_vaddr) {
+    // QEMU may add a constant offset to the emulated system's memory. Adding guest base to
+    // guest_vaddr converts it back to a "host" vaddr that can be compared against the host
+    // system's vaddrs in /proc/self/maps
+    uint64_t host_vaddr = guest_vaddr + qemu_plugin_guest_base();
+    uint64_t start = stats_enabled ? stats_now() : 0;
+
+    bool reparsed = false;
+    if (maps_stale.load(memory_order_acquire)) {
+        parse_maps();
+        reparsed = true;
+    }
+    optional<image_offset> offset = lookup(host_vaddr);
+    // Syscall tracing may miss changes to the memory map (e.g. from syscalls not in
+    // `maps_syscalls`) so re-parse once before giving up
+    if (!offset.has_value() && !reparsed) {
+        parse_maps();
+        reparsed = true;
+        offset = lookup(host_vaddr);
+    }
+    if (stats_enabled) {
+        stats_count_maps_lookup(stats_now() - start, reparsed);
+    }
+    return offset;
+}
+
+const string &image_name(uint32_t image) {
+    shared_lock<shared_mutex> guard(maps_lock);
+    return images[image];
+}
+
+const string &image_build_id(uint32_t image) {
+    string name;
+    {
+        shared_lock<shared_mutex> guard(maps_lock);
+        if (build_ids[image].has_value()) {
+            return build_ids[image].value();
+        }
+        name = images[image];
+    }
+    // Skip anonymous and special mappings like [heap] and [stack]
+    string id = (name[0] == '/') ? elf_build_id(name) : "";
+    unique_lock<shared_mutex> guard(maps_lock);
+    if (!build_ids[image].has_value()) {
+        build_ids[image] = id;
+    }
+    return build_ids[image].value();
+}
@@ -0,0 +1,34 @@
+#ifndef MAPS_H
+#define MAPS_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+typedef struct image_offset {
+    // An offset into a loaded ELF file
+    uint64_t offset;
+    // The ID of the ELF file in the image table. See `image_name`.
+    uint32_t image;
+} image_offset;
+
+// Select the syscalls which may change the memory map of the guest. This should be called once when
+// installing the plugin with the QEMU target name (e.g. "x86_64", "arm").
+void maps_init(const char *target_name);
+
+// Checks if the syscall `num` may have changed the memory map of the guest
+bool syscall_changes_maps(int64_t num);
+
+// Mark the cached copy of /proc/self/maps as stale so it's re-parsed on the next lookup
+void invalidate_maps();
+
+// Get the ELF file and the offset into it that `guest_vaddr` was loaded from
+std::optional<image_offset> guest_vaddr_to_offset(uint64_t guest_vaddr);
+
+// Get the name of an image from its ID. Anonymous mappings have an empty name.
+const std::string &image_name(uint32_t image);
+
+// Get the GNU build ID of an image as a hex string or an empty string if it doesn't have one
+const std::string &image_build_id(uint32_t image);
+
+#endif
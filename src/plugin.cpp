@@ -3,134 +3,670 @@ extern "C" {
 }
 
 #include <dlfcn.h>
+#include <array>
+#include <chrono>
 #include <string>
 #include <cstring>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <vector>
+#include <string_view>
+
+#include "adaptive.h"
+#include "builtin_backend.h"
+#include "callsites.h"
+#include "edge_table.h"
+#include "format.h"
+#include "image_filter.h"
+#include "insn_cache.h"
+#include "known_edges.h"
+#include "maps.h"
+#include "plugin.h"
+#include "prescan.h"
+#include "sampler.h"
+#include "stats.h"
+#include "symbolizer.h"
+#include "value_profile.h"
+#include "writer.h"
 
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
+// Version 3 of the plugin API (QEMU 9.1) has per-vCPU scoreboards, inline stores and conditional
+// callbacks so blocks only call into the plugin when an indirect branch was executed before them.
+// Older headers, like the one in include/, fall back to calling into the plugin for every block.
+#if QEMU_PLUGIN_VERSION >= 3
+#define COND_CALLBACKS
+#endif
+
 using namespace std;
 
 typedef bool (*arch_supported_fn)(const char *);
 typedef bool (*is_indirect_branch_fn)(uint8_t *, size_t);
 
+typedef uint32_t (*is_indirect_branch_batch_version_fn)(void);
+typedef void (*is_indirect_branch_batch_fn)(const ibresolver_insn *, size_t, bool *);
+
+typedef uint32_t (*is_indirect_branch_scan_version_fn)(void);
+
+typedef uint32_t (*indirect_branch_kinds_version_fn)(void);
+typedef void (*indirect_branch_kinds_fn)(const ibresolver_insn *, size_t, ibresolver_branch_kind *);
+
 arch_supported_fn arch_supported;
 is_indirect_branch_fn is_indirect_branch;
+// Optional. NULL if the backend doesn't implement a supported version of the batch ABI.
+is_indirect_branch_batch_fn is_indirect_branch_batch = NULL;
+// Optional. NULL if the backend doesn't implement a supported version of the branch kind ABI, in
+// which case every indirect branch has the unknown kind.
+indirect_branch_kinds_fn indirect_branch_kinds = NULL;
 
-// Address of previous callsite if it was an indirect jump/call
-static optional<uint64_t> branch_addr = {};
-
-static ofstream outfile;
-
-typedef struct image_offset {
-    // An offset into a loaded ELF file
-    uint64_t offset;
-    // The position of the image name in the /proc/self/maps entry for the
-    // corresponding offset.
-    size_t image_name_pos;
-} image_offset;
-
-// Check if the given `guest_vaddr` falls within the loaded segment described
-// by the `maps_entry` which is a line read from /proc/self/maps.
-static optional<image_offset> guest_vaddr_to_offset(const string_view maps_entry, uint64_t guest_vaddr) {
-    uint32_t name_pos;
-    uint64_t start, end, file_load_offset;
-
-    // QEMU may add a constant offset to the emulated system's memory. Adding
-    // guest base to guest_vaddr converts it back to a "host" vaddr that can
-    // be compared against the host system's vaddrs in /proc/self/maps
-    uint64_t host_vaddr = guest_vaddr + qemu_plugin_guest_base();
-
-    // Parse the /proc/self/maps line. Stores the start and end vaddrs of the
-    // loaded segment, the offset into the file the segment was loaded from
-    // (`file_load_offset`) and the number of characters in the maps string
-    // before the name of the ELF file (`name_pos`).
-    sscanf(maps_entry.data(), "%lx-%lx %*c%*c%*c%*c %lx %*lx:%*lx %*lu %n", &start, &end, &file_load_offset,
-           &name_pos);
-    // Check if the addr is within the segment. Comparing host_vaddr with the
-    // maps vaddrs is ok since it's also a system vaddr
-    if ((start <= host_vaddr) && (host_vaddr <= end)) {
-        // Get the address as an offset into the loaded segment
-        uint64_t segment_offset = host_vaddr - start;
-        // Turn the segment offset into an offset into the file
-        uint64_t file_offset = segment_offset + file_load_offset;
-        struct image_offset offset = {
-            .offset = file_offset,
-            .image_name_pos = name_pos,
-        };
-        return offset;
+typedef enum output_mode {
+    // Write a line to the output file each time an indirect branch is taken
+    STREAM,
+    // Count how many times each indirect branch edge is taken and write them all at exit
+    AGGREGATE,
+    // Like `AGGREGATE` but only count the most frequent destinations of each callsite
+    PROFILE,
+} output_mode;
+
+static output_mode mode = STREAM;
+
+static qemu_plugin_id_t plugin_id;
+
+// State for each vCPU. Each entry is padded to a cache line so vCPUs running in parallel under
+// MTTCG don't contend on the same line.
+typedef struct alignas(64) vcpu_state {
+    // Record of the previous callsite if it was an indirect jump/call, otherwise NULL
+    callsite_record *branch;
+    // Edges taken so far in `AGGREGATE` mode
+    unique_ptr<edge_table> edges;
+    // Most frequent destinations of each callsite in `PROFILE` mode
+    unique_ptr<value_profile> profile;
+    // NULL if every edge is recorded
+    unique_ptr<sampler> edge_sampler;
+    // NULL unless callsites are de-instrumented once they saturate
+    unique_ptr<callsite_tracker> tracker;
+} vcpu_state;
+
+static vcpu_state vcpus[max_vcpus];
+
+#ifdef COND_CALLBACKS
+// The record of the indirect branch each vCPU executed last or zero if the following instruction
+// was executed instead. Written by inline stores so `branch` is only set when a block starts.
+static qemu_plugin_u64 pending_branch;
+
+// This version of the API only has per-vCPU inline ops so the callsite counters are kept in
+// scoreboards, each holding the two counters of `records_per_board` records for every vCPU
+static vector<struct qemu_plugin_scoreboard *> counter_boards;
+static const size_t records_per_board = 1024;
+
+typedef enum callsite_counter {
+    EXECUTED,
+    NOT_TAKEN,
+} callsite_counter;
+#endif
+
+typedef enum file_format {
+    CSV,
+    // See format.h
+    BIN,
+} file_format;
+
+static file_format format = CSV;
+
+// Whether only some edges are recorded (see sampler.h)
+static bool sampling_enabled = false;
+static sampling_config sampling = {.period = 1, .first = 0, .budget = 0};
+
+// Whether csv rows include the functions containing the callsite and destination
+static bool symbolize_enabled = false;
+
+// Whether csv rows refer to images by ID with each image written once as an `#image` line
+static bool image_table_enabled = false;
+
+// Whether csv rows include the kind of the callsite's branch
+static bool branch_kind_enabled = false;
+
+// Where the executions of each callsite are written at exit. Empty if they aren't counted.
+static string callsites_path;
+// Only used by the writer thread, or at exit once the vCPUs are done
+static csv_image_table csv_images;
+
+// Where the stats report is written as JSON. Empty if it's only printed.
+static string stats_json_path;
+
+// Only used by the writer thread, or at exit once the vCPUs are done
+static unique_ptr<bin_encoder> encoder;
+
+// The header of the output file. When sampling it includes the number of dropped edges so it's
+// written again at exit with the final counts.
+static string output_header(const sampling_drops &dropped) {
+    const sampling_config *config = sampling_enabled ? &sampling : NULL;
+    if (format == BIN) {
+        return bin_header(mode != STREAM, mode == PROFILE, config, dropped);
+    }
+    return csv_header(mode != STREAM, symbolize_enabled, image_table_enabled, branch_kind_enabled,
+                      mode == PROFILE, config, dropped);
+}
+
+// Format an edge as a line of the output csv. `profile` is only set for edges of a value profile.
+static void format_csv_profiled(string &chunk, const edge &e, const profile_counts *profile) {
+    if (known_edges_enabled()) {
+        known_edges_add(e);
+    }
+    const string &callsite_image = image_name(e.callsite.image);
+    const string &dst_image = image_name(e.dst.image);
+    string callsite_id, dst_id;
+    if (image_table_enabled) {
+        csv_images.write(chunk, e.callsite.image, e.callsite_vaddr - e.callsite.offset,
+                         image_build_id(e.callsite.image), callsite_image);
+        csv_images.write(chunk, e.dst.image, e.dst_vaddr - e.dst.offset,
+                         image_build_id(e.dst.image), dst_image);
+        callsite_id = to_string(e.callsite.image);
+        dst_id = to_string(e.dst.image);
+    }
+    string_view callsite_column = image_table_enabled ? callsite_id : callsite_image;
+    string_view dst_column = image_table_enabled ? dst_id : dst_image;
+    string kind = branch_kind_enabled ? branch_kind_name(e.kind) : "";
+    if (symbolize_enabled) {
+        format_csv_row(chunk, e, callsite_column, dst_column, mode != STREAM, true,
+                       symbolize(callsite_image, e.callsite.offset),
+                       symbolize(dst_image, e.dst.offset), kind, profile);
+    } else {
+        format_csv_row(chunk, e, callsite_column, dst_column, mode != STREAM, false, {}, {}, kind,
+                       profile);
+    }
+}
+
+static void format_csv(string &chunk, const edge &e) { format_csv_profiled(chunk, e, NULL); }
+
+// Format an edge as a record in the binary output format. `profile` is only set for edges of a
+// value profile.
+static void format_bin_profiled(string &chunk, const edge &e, const profile_counts *profile) {
+    if (known_edges_enabled()) {
+        known_edges_add(e);
     }
-    return {};
+    encoder->encode(chunk, e, profile);
 }
 
-// Write the destination of an indirect jump/call to the output file
-static void mark_indirect_branch(uint64_t callsite_vaddr, uint64_t dst_vaddr) {
-    ifstream maps("/proc/self/maps");
-    string line;
-    optional<image_offset> callsite = {};
-    optional<image_offset> dst = {};
-    string callsite_image = "";
-    string dst_image = "";
-    // For each entry in /proc/self/maps
-    while (getline(maps, line)) {
-        if (!callsite.has_value()) {
-            callsite = guest_vaddr_to_offset(line, callsite_vaddr);
-            if (callsite.has_value()) {
-                // Copy name since `line` gets reused in this loop
-                char *image_name = line.data() + callsite->image_name_pos;
-                callsite_image = string(image_name);
+static void format_bin(string &chunk, const edge &e) { format_bin_profiled(chunk, e, NULL); }
+
+// Queue the destination of an indirect jump/call to be written to the output file
+static void mark_indirect_branch(unsigned int vcpu_idx, const callsite_record *callsite,
+                                 uint64_t dst_vaddr) {
+    // The callsite was already looked up when it was translated
+    optional<image_offset> dst = guest_vaddr_to_offset(dst_vaddr);
+    if (!callsite->resolved) {
+        cout << "ERROR: Unable to find callsite address in /proc/self/maps" << endl;
+        return;
+    }
+    if (!dst.has_value()) {
+        cout << "ERROR: Unable to find destination address in /proc/self/maps" << endl;
+        return;
+    }
+    edge e = {
+        .callsite_vaddr = callsite->vaddr,
+        .dst_vaddr = dst_vaddr,
+        .count = 1,
+        .callsite = callsite->offset,
+        .dst = dst.value(),
+        .resolved = true,
+        .kind = callsite->kind,
+    };
+    // Edges found by previous runs aren't written again
+    if (known_edges_enabled() && known_edges_contains(e)) {
+        return;
+    }
+    writer_push(vcpu_idx, e);
+};
+
+// Write the edges taken by all vCPUs to the output file
+static void write_edges() {
+    vector<edge> taken;
+    // The error bounds of the edges in `taken` in `PROFILE` mode
+    vector<profile_counts> taken_counts;
+    if (mode == PROFILE) {
+        vector<const value_profile *> profiles;
+        for (vcpu_state &vcpu : vcpus) {
+            if (vcpu.profile) {
+                profiles.push_back(vcpu.profile.get());
             }
         }
-        if (!dst.has_value()) {
-            dst = guest_vaddr_to_offset(line, dst_vaddr);
-            if (dst.has_value()) {
-                // Copy name since `line` gets reused in this loop
-                char *image_name = line.data() + dst->image_name_pos;
-                dst_image = string(image_name);
+        for (const profile_edge &p : value_profile_edges(profiles)) {
+            taken.push_back(p.e);
+            taken_counts.push_back(p.counts);
+        }
+    } else {
+        edge_table edges;
+        for (vcpu_state &vcpu : vcpus) {
+            if (vcpu.edges) {
+                edges.merge(*vcpu.edges);
             }
         }
-        // Skip the remaining entries after finding the callsite and destination
-        if (callsite.has_value() && dst.has_value()) {
-            break;
+        taken = edges.edges();
+    }
+    vector<edge> resolved;
+    vector<profile_counts> resolved_counts;
+    for (size_t i = 0; i < taken.size(); i++) {
+        const edge &e = taken[i];
+        if (e.resolved && !(known_edges_enabled() && known_edges_contains(e))) {
+            resolved.push_back(e);
+            if (mode == PROFILE) {
+                resolved_counts.push_back(taken_counts[i]);
+            }
         }
     }
-    if (!callsite.has_value()) {
-        cout << "ERROR: Unable to find callsite address in /proc/self/maps" << endl;
+    if (symbolize_enabled) {
+        vector<pair<string, uint64_t>> offsets;
+        for (const edge &e : resolved) {
+            offsets.push_back({image_name(e.callsite.image), e.callsite.offset});
+            offsets.push_back({image_name(e.dst.image), e.dst.offset});
+        }
+        symbolizer_prepare(offsets);
     }
-    if (!dst.has_value()) {
-        cout << "ERROR: Unable to find destination address in /proc/self/maps" << endl;
+    if (mode != PROFILE) {
+        writer_write_edges(resolved);
+        return;
     }
-    outfile << "0x" << hex << callsite->offset << ",";
-    outfile << "0x" << hex << dst->offset << ",";
-    outfile << "0x" << hex << callsite_vaddr << ",";
-    outfile << "0x" << hex << dst_vaddr << ",";
-    outfile << callsite_image << ",";
-    outfile << dst_image << endl;
-    return;
-};
+    // The writer's formatters only take edges so profiles are formatted here
+    string chunk;
+    for (size_t i = 0; i < resolved.size(); i++) {
+        if (format == BIN) {
+            format_bin_profiled(chunk, resolved[i], &resolved_counts[i]);
+        } else {
+            format_csv_profiled(chunk, resolved[i], &resolved_counts[i]);
+        }
+        if (chunk.size() >= 1024 * 1024) {
+            writer_write(chunk);
+            chunk.clear();
+        }
+    }
+    writer_write(chunk);
+}
+
+#ifdef COND_CALLBACKS
+// Get a callsite counter in the scoreboards, adding a scoreboard for each new batch of records
+static qemu_plugin_u64 scoreboard_counter(const callsite_record *callsite,
+                                          callsite_counter counter) {
+    size_t board = callsite->index / records_per_board;
+    while (counter_boards.size() <= board) {
+        counter_boards.push_back(
+            qemu_plugin_scoreboard_new(records_per_board * 2 * sizeof(uint64_t)));
+    }
+    size_t slot = 2 * (callsite->index % records_per_board) + counter;
+    return {.score = counter_boards[board], .offset = slot * sizeof(uint64_t)};
+}
+#endif
+
+// Count each execution of the callsite's branch with an inline op so the count doesn't need a
+// callback
+static void register_execution_counter(struct qemu_plugin_insn *insn, callsite_record *callsite) {
+#ifdef COND_CALLBACKS
+    qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(insn, QEMU_PLUGIN_INLINE_ADD_U64,
+                                                        scoreboard_counter(callsite, EXECUTED), 1);
+#else
+    // These inline ops aren't atomic so vCPUs running in parallel may lose some increments
+    qemu_plugin_register_vcpu_insn_exec_inline(insn, QEMU_PLUGIN_INLINE_ADD_U64,
+                                               &callsite->executed, 1);
+#endif
+}
+
+// Write the counts of each callsite to `callsites_path`
+static void write_callsite_report() {
+#ifdef COND_CALLBACKS
+    // Sum the per-vCPU counts into the records
+    for (callsite_record *callsite : callsite_records()) {
+        callsite->executed = qemu_plugin_u64_sum(scoreboard_counter(callsite, EXECUTED));
+        callsite->not_taken.fetch_add(qemu_plugin_u64_sum(scoreboard_counter(callsite, NOT_TAKEN)),
+                                      memory_order_relaxed);
+    }
+#endif
+    if (callsite_report_write(callsites_path.c_str())) {
+        cout << "Wrote the executions of each callsite to " << callsites_path << endl;
+    } else {
+        cout << "ERROR: Could not write callsite report " << callsites_path << endl;
+    }
+}
+
+// Callback for when a vCPU (i.e. a guest thread) is created
+static void vcpu_init(qemu_plugin_id_t id, unsigned int vcpu_idx) {
+    if (vcpu_idx >= max_vcpus) {
+        cout << "ERROR: Branches taken by vCPU " << vcpu_idx << " will not be recorded" << endl;
+        return;
+    }
+    vcpu_state &vcpu = vcpus[vcpu_idx];
+    vcpu.branch = NULL;
+#ifdef COND_CALLBACKS
+    qemu_plugin_u64_set(pending_branch, vcpu_idx, 0);
+#endif
+    writer_add_vcpu(vcpu_idx);
+    // Edges are kept when a vCPU exits so a vCPU reusing the index may already have a table
+    if ((mode == AGGREGATE) && !vcpu.edges) {
+        vcpu.edges = make_unique<edge_table>();
+    }
+    if ((mode == PROFILE) && !vcpu.profile) {
+        vcpu.profile = make_unique<value_profile>();
+    }
+    if (sampling_enabled && !vcpu.edge_sampler) {
+        vcpu.edge_sampler = make_unique<sampler>(vcpu_idx);
+    }
+    if (adaptive_enabled() && !vcpu.tracker) {
+        vcpu.tracker = make_unique<callsite_tracker>();
+    }
+}
+
+// Callback for when a vCPU exits
+static void vcpu_exit(qemu_plugin_id_t id, unsigned int vcpu_idx) {
+    if (vcpu_idx < max_vcpus) {
+        vcpus[vcpu_idx].branch = NULL;
+    }
+#ifdef COND_CALLBACKS
+    qemu_plugin_u64_set(pending_branch, vcpu_idx, 0);
+#endif
+}
+
+// Callback for when the guest program exits
+static void plugin_exit(qemu_plugin_id_t id, void *userdata) {
+    if (mode != STREAM) {
+        write_edges();
+    }
+    insn_cache_save();
+    if (!callsites_path.empty()) {
+        write_callsite_report();
+    }
+    if (adaptive_enabled()) {
+        cout << "Adaptive mode de-instrumented " << adaptive_num_saturated() << " callsites with "
+             << adaptive_num_retranslations() << " retranslations" << endl;
+    }
+    if (sampling_enabled) {
+        sampling_drops total = {};
+        for (vcpu_state &vcpu : vcpus) {
+            if (vcpu.edge_sampler) {
+                total.period += vcpu.edge_sampler->dropped().period;
+                total.first += vcpu.edge_sampler->dropped().first;
+                total.budget += vcpu.edge_sampler->dropped().budget;
+            }
+        }
+        cout << "Sampling dropped " << total.period << " edges by period, " << total.first
+             << " edges after the first executions and " << total.budget
+             << " edges over the budget" << endl;
+        if (!writer_overwrite(0, output_header(total))) {
+            cout << "WARNING: Could not update the sampling counts in the output header" << endl;
+        }
+    }
+    size_t dropped = writer_stop();
+    if (dropped) {
+        cout << "WARNING: " << dropped << " indirect branches were dropped since the output could "
+             << "not keep up" << endl;
+    }
+    // Edges are added to the database as they're written so this must be after the writer stops
+    if (known_edges_enabled()) {
+        long added = known_edges_save();
+        if (added >= 0) {
+            cout << "Added " << added << " new edges to the known edge database" << endl;
+        }
+    }
+    if (stats_enabled) {
+        stats_report(stats_json_path.empty() ? NULL : stats_json_path.c_str());
+    }
+}
+
+// Callback for syscalls returning to the guest. Invalidates the cached memory map if the syscall
+// may have mapped or unmapped memory.
+static void syscall_ret(qemu_plugin_id_t id, unsigned int vcpu_idx, int64_t num, int64_t ret) {
+    if (syscall_changes_maps(num)) {
+        invalidate_maps();
+        insn_cache_maps_changed();
+    }
+}
+
+// Record the edge if the previous instruction was an indirect branch
+static inline void end_branch(unsigned int vcpu_idx, void *dst_vaddr) {
+    vcpu_state &vcpu = vcpus[vcpu_idx];
+    if (vcpu.branch) {
+        callsite_record *callsite = vcpu.branch;
+        uint64_t callsite_vaddr = callsite->vaddr;
+        vcpu.branch = NULL;
+        // QEMU ends a block after an indirect branch so a branch that falls through continues in
+        // the block starting right after it. That's not an edge. Branches of the unknown kind may
+        // also really be taken to the next instruction so they're always recorded.
+        if ((callsite->kind & IBRESOLVER_BRANCH_CONDITIONAL) &&
+            ((uint64_t)dst_vaddr == callsite_vaddr + callsite->size)) {
+            if (!callsites_path.empty()) {
+                callsite->not_taken.fetch_add(1, memory_order_relaxed);
+            }
+            return;
+        }
+        // Saturation only depends on the destinations so it must see edges that aren't sampled
+        if (vcpu.tracker) {
+            vcpu.tracker->observe(callsite, (uint64_t)dst_vaddr);
+        }
+        // Decide whether to record the edge before doing any work for it
+        if (vcpu.edge_sampler && !vcpu.edge_sampler->keep(callsite_vaddr)) {
+            return;
+        }
+        if (mode == AGGREGATE) {
+            vcpu.edges->add(callsite_vaddr, (uint64_t)dst_vaddr, callsite->kind);
+        } else if (mode == PROFILE) {
+            vcpu.profile->add(callsite_vaddr, (uint64_t)dst_vaddr, callsite->kind);
+        } else {
+            mark_indirect_branch(vcpu_idx, callsite, (uint64_t)dst_vaddr);
+        }
+    }
+}
 
 // Callback for insn at the start of a block
 static void branch_taken(unsigned int vcpu_idx, void *dst_vaddr) {
-    if (branch_addr.has_value()) {
-        mark_indirect_branch(branch_addr.value(), (uint64_t)dst_vaddr);
-        branch_addr = {};
+    if (vcpu_idx >= max_vcpus) {
+        return;
     }
+    stats_count_callback(vcpu_idx, BRANCH_TAKEN);
+    end_branch(vcpu_idx, dst_vaddr);
 }
 
-// Callback for insn following an indirect branch
-static void branch_skipped(unsigned int vcpu_idx, void *userdata) { branch_addr = {}; }
+// Callback for insn following an indirect branch in the same block
+static void branch_skipped(unsigned int vcpu_idx, void *userdata) {
+    if (vcpu_idx < max_vcpus) {
+        vcpu_state &vcpu = vcpus[vcpu_idx];
+        stats_count_callback(vcpu_idx, BRANCH_SKIPPED);
+        if (vcpu.branch && !callsites_path.empty()) {
+            vcpu.branch->not_taken.fetch_add(1, memory_order_relaxed);
+        }
+        vcpu.branch = NULL;
+    }
+}
 
 // Callback for indirect branch insn
-static void indirect_branch_exec(unsigned int vcpu_idx, void *callsite_addr) {
-    branch_addr = (uint64_t)callsite_addr;
+static void indirect_branch_exec(unsigned int vcpu_idx, void *callsite) {
+    if (vcpu_idx < max_vcpus) {
+        stats_count_callback(vcpu_idx, INDIRECT_BRANCH_EXEC);
+        vcpus[vcpu_idx].branch = (callsite_record *)callsite;
+    }
 }
 
 // Callback for indirect branch which may also be the destination of another branch
-static void indirect_branch_at_start(unsigned int vcpu_idx, void *callsite_addr) {
-    branch_taken(vcpu_idx, callsite_addr);
-    indirect_branch_exec(vcpu_idx, callsite_addr);
+static void indirect_branch_at_start(unsigned int vcpu_idx, void *callsite) {
+    if (vcpu_idx >= max_vcpus) {
+        return;
+    }
+    callsite_record *record = (callsite_record *)callsite;
+    stats_count_callback(vcpu_idx, INDIRECT_BRANCH_AT_START);
+    end_branch(vcpu_idx, (void *)record->vaddr);
+    vcpus[vcpu_idx].branch = record;
+}
+
+// Callback for the start of a block in an image that isn't selected by the image filters. Edges into
+// the block aren't recorded.
+static void branch_filtered(unsigned int vcpu_idx, void *userdata) {
+    if (vcpu_idx < max_vcpus) {
+        stats_count_callback(vcpu_idx, BRANCH_FILTERED);
+        vcpus[vcpu_idx].branch = NULL;
+    }
+}
+
+#ifdef COND_CALLBACKS
+// Callback for the start of a block which is only called if an indirect branch is pending
+static void branch_taken_cond(unsigned int vcpu_idx, void *dst_vaddr) {
+    if (vcpu_idx >= max_vcpus) {
+        return;
+    }
+    vcpus[vcpu_idx].branch = (callsite_record *)qemu_plugin_u64_get(pending_branch, vcpu_idx);
+    qemu_plugin_u64_set(pending_branch, vcpu_idx, 0);
+    branch_taken(vcpu_idx, dst_vaddr);
+}
+#endif
+
+// Register the execution callbacks marking the start of a block at `start_vaddr`
+static void register_block_start(struct qemu_plugin_insn *insn, uint64_t start_vaddr) {
+#ifdef COND_CALLBACKS
+    qemu_plugin_register_vcpu_insn_exec_cond_cb(insn, branch_taken_cond, QEMU_PLUGIN_CB_NO_REGS,
+                                                QEMU_PLUGIN_COND_NE, pending_branch, 0,
+                                                (void *)start_vaddr);
+#else
+    qemu_plugin_register_vcpu_insn_exec_cb(insn, branch_taken, QEMU_PLUGIN_CB_NO_REGS,
+                                           (void *)start_vaddr);
+#endif
+}
+
+// Register the execution callbacks for an indirect branch at the start of a block
+static void register_branch_at_start(struct qemu_plugin_insn *insn, callsite_record *callsite) {
+#ifdef COND_CALLBACKS
+    // The conditional callback must run before the store that marks this branch as pending
+    register_block_start(insn, callsite->vaddr);
+    qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(insn, QEMU_PLUGIN_INLINE_STORE_U64,
+                                                        pending_branch, (uint64_t)callsite);
+#else
+    qemu_plugin_register_vcpu_insn_exec_cb(insn, indirect_branch_at_start, QEMU_PLUGIN_CB_NO_REGS,
+                                           callsite);
+#endif
+}
+
+// Register the execution callbacks for an indirect branch in the middle of a block
+static void register_branch(struct qemu_plugin_insn *insn, callsite_record *callsite) {
+#ifdef COND_CALLBACKS
+    qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(insn, QEMU_PLUGIN_INLINE_STORE_U64,
+                                                        pending_branch, (uint64_t)callsite);
+#else
+    qemu_plugin_register_vcpu_insn_exec_cb(insn, indirect_branch_exec, QEMU_PLUGIN_CB_NO_REGS,
+                                           callsite);
+#endif
+}
+
+// Register the execution callbacks for an instruction that drops a pending branch, i.e. the start
+// of a block in a filtered image
+static void register_branch_cleared(struct qemu_plugin_insn *insn,
+                                    qemu_plugin_vcpu_udata_cb_t cb) {
+#ifdef COND_CALLBACKS
+    qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(insn, QEMU_PLUGIN_INLINE_STORE_U64,
+                                                        pending_branch, 0);
+#else
+    qemu_plugin_register_vcpu_insn_exec_cb(insn, cb, QEMU_PLUGIN_CB_NO_REGS, NULL);
+#endif
+}
+
+// Register the execution callbacks for the instruction following a branch in the same block, which
+// drop the pending branch and count it as not taken
+static void register_branch_skipped(struct qemu_plugin_insn *insn, callsite_record *callsite) {
+#ifdef COND_CALLBACKS
+    register_branch_cleared(insn, NULL);
+    if (!callsites_path.empty()) {
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64, scoreboard_counter(callsite, NOT_TAKEN), 1);
+    }
+#else
+    register_branch_cleared(insn, branch_skipped);
+#endif
+}
+
+// Callback for when QEMU flushes all translated blocks
+static void tb_flush(qemu_plugin_id_t id) { insn_cache_flush(); }
+
+// Whether execution may continue with the instruction after a branch of this kind. Backends that
+// don't report kinds give every branch the unknown kind so it's handled like a conditional one.
+static bool may_fall_through(ibresolver_branch_kind kind) {
+    return (kind & IBRESOLVER_BRANCH_CONDITIONAL) ||
+           ((kind & IBRESOLVER_BRANCH_KIND_MASK) == IBRESOLVER_BRANCH_UNKNOWN);
+}
+
+// Get the branch kind of each instruction in a block, only calling the backend if some instruction
+// is not in the classification cache. `block_start` is where the block was loaded from, if known.
+static void classify_block(struct qemu_plugin_tb *tb, const optional<image_offset> &block_start,
+                           vector<ibresolver_branch_kind> &kinds) {
+    size_t num_insns = kinds.size();
+    vector<ibresolver_insn> insns(num_insns);
+    vector<bool> cached(num_insns);
+    bool all_cached = true;
+#ifdef COND_CALLBACKS
+    // This version of the API copies the instruction's bytes instead of returning a pointer. No
+    // supported architecture has instructions longer than 15 bytes.
+    vector<array<uint8_t, 16>> data(num_insns);
+#endif
+    for (size_t i = 0; i < num_insns; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        insns[i] = {
+#ifdef COND_CALLBACKS
+            .data = data[i].data(),
+            .size = qemu_plugin_insn_data(insn, data[i].data(), data[i].size()),
+#else
+            .data = (const uint8_t *)qemu_plugin_insn_data(insn),
+            .size = qemu_plugin_insn_size(insn),
+#endif
+            .vaddr = qemu_plugin_insn_vaddr(insn),
+        };
+    }
+    // The same bytes may be classified differently in ARM and THUMB blocks
+    insn_set set = insn_cache_block_set(insns.data(), num_insns);
+    for (size_t i = 0; i < num_insns; i++) {
+        optional<ibresolver_branch_kind> result =
+            insn_cache_lookup(insns[i].vaddr, insns[i].data, insns[i].size, set);
+        // Instructions the pre-scan ruled out are cached so later translations don't need the scan.
+        // The rest of the block is assumed to be loaded from the same file as its start, which the
+        // pre-scan checks by comparing the bytes.
+        if (!result.has_value() && prescan_enabled() && block_start.has_value() &&
+            prescan_rules_out({.offset = block_start->offset + (insns[i].vaddr - insns[0].vaddr),
+                               .image = block_start->image},
+                              insns[i].data, insns[i].size)) {
+            insn_cache_insert(insns[i].vaddr, insns[i].data, insns[i].size, set,
+                              IBRESOLVER_NOT_BRANCH);
+            result = IBRESOLVER_NOT_BRANCH;
+        }
+        cached[i] = result.has_value();
+        kinds[i] = result.value_or(IBRESOLVER_NOT_BRANCH);
+        all_cached &= cached[i];
+    }
+    if (all_cached) {
+        stats_count_translation(num_insns, 0, 0);
+        return;
+    }
+    size_t num_classified = 0;
+    uint64_t start = stats_now();
+    // Pass the whole block to the batch ABIs so the backend has the context of the surrounding
+    // instructions
+    if (indirect_branch_kinds) {
+        indirect_branch_kinds(insns.data(), num_insns, kinds.data());
+        num_classified = num_insns;
+    } else if (is_indirect_branch_batch) {
+        unique_ptr<bool[]> results(new bool[num_insns]());
+        is_indirect_branch_batch(insns.data(), num_insns, results.get());
+        for (size_t i = 0; i < num_insns; i++) {
+            kinds[i] = results[i] ? IBRESOLVER_BRANCH_UNKNOWN : IBRESOLVER_NOT_BRANCH;
+        }
+        num_classified = num_insns;
+    } else {
+        for (size_t i = 0; i < num_insns; i++) {
+            if (!cached[i]) {
+                bool is_branch = is_indirect_branch((uint8_t *)insns[i].data, insns[i].size);
+                kinds[i] = is_branch ? IBRESOLVER_BRANCH_UNKNOWN : IBRESOLVER_NOT_BRANCH;
+                num_classified++;
+            }
+        }
+    }
+    stats_count_translation(num_insns, num_classified, stats_now() - start);
+    for (size_t i = 0; i < num_insns; i++) {
+        if (!cached[i]) {
+            insn_cache_insert(insns[i].vaddr, insns[i].data, insns[i].size, set, kinds[i]);
+        }
+    }
 }
 
 // Register a callback for each time a block is executed
@@ -138,82 +674,379 @@ static void block_trans_handler(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
     uint64_t start_vaddr = qemu_plugin_tb_vaddr(tb);
     size_t num_insns = qemu_plugin_tb_n_insns(tb);
 
+    // Look up the block's image once for both the image filter and the pre-scan
+    optional<image_offset> start;
+    if ((image_filter_enabled() || prescan_enabled()) && num_insns) {
+        start = guest_vaddr_to_offset(start_vaddr);
+    }
+    // Branches in blocks from filtered images are never recorded so the block only needs to drop a
+    // pending branch from a selected image. Blocks that can't be found in the memory map are kept.
+    if (image_filter_enabled()) {
+        if (start.has_value() && !image_selected(start->image)) {
+            register_branch_cleared(qemu_plugin_tb_get_insn(tb, 0), branch_filtered);
+            return;
+        }
+    }
+
+    // Classify each instruction once up front since the loop below also needs to know if the next
+    // instruction is a branch
+    vector<ibresolver_branch_kind> kinds(num_insns);
+    classify_block(tb, start, kinds);
+    vector<callsite_record *> callsites(num_insns, NULL);
     for (size_t i = 0; i < num_insns; i++) {
-        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
-        uint64_t insn_addr = qemu_plugin_insn_vaddr(insn);
+        if (kinds[i]) {
+            struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+            callsites[i] = callsite_record_get(qemu_plugin_insn_vaddr(insn),
+                                               qemu_plugin_insn_size(insn), kinds[i]);
+            // Saturated callsites are translated like any other instruction so they don't get
+            // callbacks. Blocks still mark their start since instrumented callsites may branch to
+            // them.
+            if (adaptive_enabled() && adaptive_saturated(callsites[i])) {
+                kinds[i] = IBRESOLVER_NOT_BRANCH;
+            }
+        }
+    }
 
-        uint8_t *insn_data = (uint8_t *)qemu_plugin_insn_data(insn);
-        size_t insn_size = qemu_plugin_insn_size(insn);
+    for (size_t i = 0; i < num_insns; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
 
-        bool insn_is_branch = is_indirect_branch(insn_data, insn_size);
-        // The callback for the first instruction in a block should mark the indirect branch
-        // destination if one was taken
-        if (i == 0) {
-            if (!insn_is_branch) {
-                qemu_plugin_register_vcpu_insn_exec_cb(insn, branch_taken, QEMU_PLUGIN_CB_NO_REGS,
-                                                       (void *)start_vaddr);
-            } else {
-                // If the first branch is also an indirect branch, the callback must mark the
-                // destination and update `branch_addr`
-                qemu_plugin_register_vcpu_insn_exec_cb(insn, indirect_branch_at_start,
-                                                       QEMU_PLUGIN_CB_NO_REGS, (void *)start_vaddr);
-                // In this case the second insn should clear `branch_addr` like below
-                if (num_insns > 1) {
-                    struct qemu_plugin_insn *next_insn = qemu_plugin_tb_get_insn(tb, 1);
-                    qemu_plugin_register_vcpu_insn_exec_cb(next_insn, branch_skipped,
-                                                           QEMU_PLUGIN_CB_NO_REGS, NULL);
-                }
+        if (kinds[i] == IBRESOLVER_NOT_BRANCH) {
+            // The callback for the first instruction in a block should mark the indirect branch
+            // destination if one was taken
+            if (i == 0) {
+                register_block_start(insn, start_vaddr);
             }
+            continue;
+        }
+        callsite_record *callsite = callsites[i];
+        if (i == 0) {
+            // If the first branch is also an indirect branch, the callback must mark the
+            // destination and update `branch`
+            register_branch_at_start(insn, callsite);
         } else {
-            if (insn_is_branch) {
-                qemu_plugin_register_vcpu_insn_exec_cb(insn, indirect_branch_exec,
-                                                       QEMU_PLUGIN_CB_NO_REGS, (void *)insn_addr);
-                if (i + 1 < num_insns) {
-                    struct qemu_plugin_insn *next_insn = qemu_plugin_tb_get_insn(tb, i + 1);
-                    uint8_t *next_data = (uint8_t *)qemu_plugin_insn_data(next_insn);
-                    size_t next_size = qemu_plugin_insn_size(next_insn);
-                    if (is_indirect_branch(next_data, next_size)) {
-                        cout << "WARNING: Consecutive indirect branches are currently not handled properly" << endl;
-                    }
-                    qemu_plugin_register_vcpu_insn_exec_cb(next_insn, branch_skipped,
-                                                           QEMU_PLUGIN_CB_NO_REGS, NULL);
-                }
+            register_branch(insn, callsite);
+        }
+        if (!callsites_path.empty()) {
+            register_execution_counter(insn, callsite);
+        }
+        // Only branches that may fall through need the next instruction to clear `branch`
+        if ((i + 1 < num_insns) && may_fall_through(kinds[i])) {
+            struct qemu_plugin_insn *next_insn = qemu_plugin_tb_get_insn(tb, i + 1);
+            if (kinds[i + 1]) {
+                cout << "WARNING: Consecutive indirect branches are currently not handled properly" << endl;
             }
+            register_branch_skipped(next_insn, callsite);
         }
     }
 }
 
+static void register_callbacks(qemu_plugin_id_t id);
+
+// Callback for when QEMU removed all callbacks and translated blocks after `qemu_plugin_reset`
+static void plugin_reset(qemu_plugin_id_t id) {
+    adaptive_retranslated();
+    register_callbacks(id);
+}
+
+// Make QEMU retranslate all blocks so saturated callsites aren't instrumented anymore. QEMU only
+// resets once the vCPUs leave the blocks they're executing.
+static void request_retranslation() { qemu_plugin_reset(plugin_id, plugin_reset); }
+
+static void register_callbacks(qemu_plugin_id_t id) {
+    qemu_plugin_register_vcpu_syscall_ret_cb(id, syscall_ret);
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    qemu_plugin_register_vcpu_exit_cb(id, vcpu_exit);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+    // Register a callback for each time a block is translated
+    qemu_plugin_register_vcpu_tb_trans_cb(id, block_trans_handler);
+    qemu_plugin_register_flush_cb(id, tb_flush);
+}
+
 int loading_sym_failed(const char *sym, const char *backend_name) {
     cout << "Could not load `" << sym << "` function from backend " << backend_name << endl;
     cout << dlerror() << endl;
     return -4;
 }
 
+static void print_usage() {
+    cout << "Usage: /path/to/qemu \\" << endl;
+    cout << "\t-plugin /path/to/libibresolver.so,output=\"output.csv\"|unix:/path/to/socket,backend=\"/path/to/disassembly/libbackend.so\" \\" << endl;
+    cout << "\t[,mode=stream|aggregate][,profile=topk:K][,format=csv|bin][,compress=gzip|zstd|off] \\" << endl;
+    cout << "\t[,flush_ms=N][,backpressure=block|drop] \\" << endl;
+    cout << "\t[,insn_cache=/path/to/cache][,prescan=on|off][,prescan_cache=/path/to/dir] \\" << endl;
+    cout << "\t[,sample=1/N][,first=K][,budget=EDGES_PER_SECOND][,stats=text|json] \\" << endl;
+    cout << "\t[,include=GLOB|main][,exclude=GLOB|main] \\" << endl;
+    cout << "\t[,adaptive=EXECUTIONS][,adaptive_targets=N][,adaptive_batch=CALLSITES] \\" << endl;
+    cout << "\t[,symbolize=on|off][,image_table=on|off][,branch_kind=on|off] \\" << endl;
+    cout << "\t[,known=/path/to/known_edges][,callsites=/path/to/callsites.csv] \\" << endl;
+    cout << "\t$BINARY" << endl;
+}
+
+// Parse a positive integer argument
+static bool parse_count(const char *value, uint64_t &count) {
+    char *end;
+    count = strtoull(value, &end, 10);
+    return (*value != '\0') && (*end == '\0') && (count != 0);
+}
+
 extern int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info, int argc,
                                char **argv) {
-    if (argc < 1) {
-        cout << "Usage: /path/to/qemu \\" << endl;
-        cout << "\t-plugin /path/to/libibresolver.so,output=\"output.csv\",backend=\"/path/to/disassembly/libbackend.so\" \\" << endl;
-        cout << "\t$BINARY" << endl;
+    const char *output_arg = NULL;
+    const char *backend_arg = NULL;
+    const char *insn_cache_arg = NULL;
+    const char *known_arg = NULL;
+    bool prescan_arg = false;
+    const char *prescan_cache_arg = NULL;
+    size_t flush_ms = 100;
+    full_policy policy = BLOCK;
+    bool stats_arg = false;
+    bool stats_json = false;
+    bool format_arg = false;
+    bool mode_arg = false;
+    uint64_t profile_k = 0;
+    compression compression_arg = NO_COMPRESSION;
+    bool adaptive_arg = false;
+    adaptive_config adaptive = {.stable_executions = 0, .targets = 4, .batch = 16};
+
+    // Each plugin argument has the form `key=value`
+    for (int i = 0; i < argc; i++) {
+        string_view arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (eq == string_view::npos) {
+            cout << "Invalid plugin argument `" << arg << "`" << endl;
+            print_usage();
+            return -1;
+        }
+        string_view key = arg.substr(0, eq);
+        const char *value = argv[i] + eq + 1;
+        if (key == "output") {
+            output_arg = value;
+        } else if (key == "backend") {
+            backend_arg = value;
+        } else if (key == "insn_cache") {
+            insn_cache_arg = value;
+        } else if (key == "include") {
+            image_filter_include(value);
+        } else if (key == "exclude") {
+            image_filter_exclude(value);
+        } else if (key == "prescan") {
+            if (!strcmp(value, "on")) {
+                prescan_arg = true;
+            } else if (!strcmp(value, "off")) {
+                prescan_arg = false;
+            } else {
+                cout << "Unknown prescan option `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "prescan_cache") {
+            prescan_arg = true;
+            prescan_cache_arg = value;
+        } else if (key == "known") {
+            known_arg = value;
+        } else if (key == "callsites") {
+            callsites_path = value;
+        } else if (key == "mode") {
+            mode_arg = true;
+            if (!strcmp(value, "stream")) {
+                mode = STREAM;
+            } else if (!strcmp(value, "aggregate")) {
+                mode = AGGREGATE;
+            } else {
+                cout << "Unknown output mode `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "profile") {
+            if (strncmp(value, "topk:", 5) || !parse_count(value + 5, profile_k) ||
+                (profile_k > max_profile_targets)) {
+                cout << "Invalid profile `" << value << "`. Only `topk:K` with K at most "
+                     << max_profile_targets << " is supported." << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "format") {
+            format_arg = true;
+            if (!strcmp(value, "csv")) {
+                format = CSV;
+            } else if (!strcmp(value, "bin")) {
+                format = BIN;
+            } else {
+                cout << "Unknown output format `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "flush_ms") {
+            char *end;
+            flush_ms = strtoul(value, &end, 10);
+            if ((*value == '\0') || (*end != '\0') || (flush_ms == 0)) {
+                cout << "Invalid flush interval `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "compress") {
+            if (!strcmp(value, "gzip")) {
+                compression_arg = GZIP;
+            } else if (!strcmp(value, "zstd")) {
+                compression_arg = ZSTD;
+            } else if (!strcmp(value, "off")) {
+                compression_arg = NO_COMPRESSION;
+            } else {
+                cout << "Unknown compression format `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+            if (!compression_supported(compression_arg)) {
+                cout << "The plugin was built without " << value << " support. Rebuild it with "
+                     << "`make ZSTD=1`." << endl;
+                return -1;
+            }
+        } else if (key == "backpressure") {
+            if (!strcmp(value, "block")) {
+                policy = BLOCK;
+            } else if (!strcmp(value, "drop")) {
+                policy = DROP;
+            } else {
+                cout << "Unknown backpressure policy `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "stats") {
+            if (!strcmp(value, "text")) {
+                stats_arg = true;
+            } else if (!strcmp(value, "json")) {
+                stats_arg = true;
+                stats_json = true;
+            } else {
+                cout << "Unknown stats format `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "symbolize") {
+            if (!strcmp(value, "on")) {
+                symbolize_enabled = true;
+            } else if (!strcmp(value, "off")) {
+                symbolize_enabled = false;
+            } else {
+                cout << "Unknown symbolize option `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "image_table") {
+            if (!strcmp(value, "on")) {
+                image_table_enabled = true;
+            } else if (!strcmp(value, "off")) {
+                image_table_enabled = false;
+            } else {
+                cout << "Unknown image_table option `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "branch_kind") {
+            if (!strcmp(value, "on")) {
+                branch_kind_enabled = true;
+            } else if (!strcmp(value, "off")) {
+                branch_kind_enabled = false;
+            } else {
+                cout << "Unknown branch_kind option `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "sample") {
+            if (strncmp(value, "1/", 2) || !parse_count(value + 2, sampling.period)) {
+                cout << "Invalid sampling rate `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+            sampling_enabled = true;
+        } else if (key == "first") {
+            if (!parse_count(value, sampling.first)) {
+                cout << "Invalid number of executions `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+            sampling_enabled = true;
+        } else if (key == "budget") {
+            if (!parse_count(value, sampling.budget)) {
+                cout << "Invalid edge budget `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+            sampling_enabled = true;
+        } else if (key == "adaptive") {
+            if (!parse_count(value, adaptive.stable_executions)) {
+                cout << "Invalid number of executions `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+            adaptive_arg = true;
+        } else if (key == "adaptive_targets") {
+            if (!parse_count(value, adaptive.targets) || (adaptive.targets > max_targets)) {
+                cout << "Invalid number of destinations `" << value << "`. It must be at most "
+                     << max_targets << "." << endl;
+                print_usage();
+                return -1;
+            }
+        } else if (key == "adaptive_batch") {
+            if (!parse_count(value, adaptive.batch)) {
+                cout << "Invalid number of callsites `" << value << "`" << endl;
+                print_usage();
+                return -1;
+            }
+        } else {
+            cout << "Unknown plugin argument `" << key << "`" << endl;
+            print_usage();
+            return -1;
+        }
+    }
+    if (!output_arg) {
+        print_usage();
+        return -1;
+    }
+    // A profile replaces the output mode
+    if (profile_k && mode_arg) {
+        cout << "A profile is written instead of the edges so `profile` can't be used with `mode`"
+             << endl;
+        return -1;
+    }
+    if (profile_k) {
+        mode = PROFILE;
+        value_profile_init(profile_k);
+    }
+    // Consumers of a socket get the binary format unless csv was asked for
+    bool socket_output = !strncmp(output_arg, socket_prefix, strlen(socket_prefix));
+    if (socket_output && !format_arg) {
+        format = BIN;
+    }
+    if (symbolize_enabled && (format == BIN)) {
+        cout << "The binary format does not store symbols. Use `bin2csv --symbolize` instead."
+             << endl;
+        return -1;
+    }
+    if (branch_kind_enabled && (format == BIN)) {
+        cout << "The binary format does not store branch kinds. Use `format=csv` instead." << endl;
         return -1;
     }
 
-    const char *output_arg = argv[0] + sizeof("output=") - 1;
-
-    outfile = ofstream(output_arg);
-    if (outfile.fail()) {
-        cout << "Could not open file " << output_arg << endl;
+    if (!writer_open(output_arg, compression_arg)) {
+        cout << "Could not " << (socket_output ? "connect to " : "open file ") << output_arg
+             << endl;
         return -2;
     }
 
-    bool backend_provided = argc == 2;
+    bool backend_provided = backend_arg != NULL;
     void *backend_handle = RTLD_DEFAULT;
     const char *arch_supported_fn_name = "arch_supported_default_impl";
     const char *is_indirect_branch_fn_name = "is_indirect_branch_default_impl";
+    const char *batch_version_fn_name = "is_indirect_branch_batch_version_default_impl";
+    const char *batch_fn_name = "is_indirect_branch_batch_default_impl";
+    const char *scan_version_fn_name = "is_indirect_branch_scan_version_default_impl";
+    const char *scan_fn_name = "is_indirect_branch_scan_default_impl";
+    const char *kinds_version_fn_name = "indirect_branch_kinds_version_default_impl";
+    const char *kinds_fn_name = "indirect_branch_kinds_default_impl";
     const char *backend_name = BACKEND_NAME;
 
     if (backend_provided) {
-        const char *backend_arg = argv[1] + sizeof("backend=") - 1;
         backend_handle = dlopen(backend_arg, RTLD_LAZY | RTLD_DEEPBIND);
         if (!backend_handle) {
             cout << "Could not open shared library for alternate disassembly backend" << endl;
@@ -222,9 +1055,14 @@ extern int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info, int
         }
         arch_supported_fn_name = "arch_supported";
         is_indirect_branch_fn_name = "is_indirect_branch";
+        batch_version_fn_name = "is_indirect_branch_batch_version";
+        batch_fn_name = "is_indirect_branch_batch";
+        scan_version_fn_name = "is_indirect_branch_scan_version";
+        scan_fn_name = "is_indirect_branch_scan";
+        kinds_version_fn_name = "indirect_branch_kinds_version";
+        kinds_fn_name = "indirect_branch_kinds";
         backend_name = backend_arg;
     }
-    cout << "Using the " << backend_name << " disassembly backend" << endl;
     arch_supported = (arch_supported_fn)dlsym(backend_handle, arch_supported_fn_name);
     if (dlerror()) {
         return loading_sym_failed(arch_supported_fn_name, backend_name);
@@ -233,15 +1071,105 @@ extern int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info, int
     if (dlerror()) {
         return loading_sym_failed(is_indirect_branch_fn_name, backend_name);
     }
+    // The batch ABI is optional so backends written before it was added keep working
+    auto batch_version = (is_indirect_branch_batch_version_fn)dlsym(backend_handle,
+                                                                     batch_version_fn_name);
+    auto batch = (is_indirect_branch_batch_fn)dlsym(backend_handle, batch_fn_name);
+    dlerror();
+    if (batch_version && batch) {
+        if (batch_version() == IBRESOLVER_BATCH_ABI_VERSION) {
+            is_indirect_branch_batch = batch;
+        } else {
+            cout << "WARNING: Ignoring `" << batch_fn_name << "` since backend " << backend_name
+                 << " implements batch ABI version " << batch_version() << " instead of "
+                 << IBRESOLVER_BATCH_ABI_VERSION << endl;
+        }
+    }
+    // Without branch kinds every indirect branch is treated as one that may fall through
+    auto kinds_version = (indirect_branch_kinds_version_fn)dlsym(backend_handle,
+                                                                 kinds_version_fn_name);
+    auto kinds = (indirect_branch_kinds_fn)dlsym(backend_handle, kinds_fn_name);
+    dlerror();
+    if (kinds_version && kinds) {
+        if (kinds_version() == IBRESOLVER_KIND_ABI_VERSION) {
+            indirect_branch_kinds = kinds;
+        } else {
+            cout << "WARNING: Ignoring `" << kinds_fn_name << "` since backend " << backend_name
+                 << " implements branch kind ABI version " << kinds_version() << " instead of "
+                 << IBRESOLVER_KIND_ABI_VERSION << endl;
+        }
+    }
 
+    // Pre-scanning is only possible if the backend can scan whole segments
+    is_indirect_branch_scan_fn scan = NULL;
+    if (prescan_arg) {
+        auto scan_version = (is_indirect_branch_scan_version_fn)dlsym(backend_handle,
+                                                                       scan_version_fn_name);
+        scan = (is_indirect_branch_scan_fn)dlsym(backend_handle, scan_fn_name);
+        dlerror();
+        if (!scan_version || !scan) {
+            cout << "WARNING: Not pre-scanning since backend " << backend_name
+                 << " doesn't implement `" << scan_fn_name << "`" << endl;
+            scan = NULL;
+        } else if (scan_version() != IBRESOLVER_SCAN_ABI_VERSION) {
+            cout << "WARNING: Not pre-scanning since backend " << backend_name
+                 << " implements scan ABI version " << scan_version() << " instead of "
+                 << IBRESOLVER_SCAN_ABI_VERSION << endl;
+            scan = NULL;
+        }
+    }
+
+    // Backends may defer expensive setup to the first translation (e.g. the Binary Ninja backend
+    // loads its architecture then) so this only measures what's done before the guest starts
+    auto init_start = chrono::steady_clock::now();
     if (!arch_supported(info->target_name)) {
         cout << "Could not initialize disassembly backend for " << info->target_name << endl;
         return -5;
     }
+    double init_ms =
+        chrono::duration<double, milli>(chrono::steady_clock::now() - init_start).count();
+    cout << "Using the " << backend_name << " disassembly backend (initialized in " << init_ms
+         << " ms)" << endl;
 
-    outfile << "callsite offset,dest offset,callsite vaddr,dest vaddr,callsite ELF,dest ELF" << endl;
-    // Register a callback for each time a block is translated
-    qemu_plugin_register_vcpu_tb_trans_cb(id, block_trans_handler);
+    if (stats_arg) {
+        stats_init();
+        if (stats_json) {
+            const char *output_path = output_arg + (socket_output ? strlen(socket_prefix) : 0);
+            stats_json_path = string(output_path) + ".stats.json";
+        }
+    }
+    sampler_init(sampling);
+    writer_write(output_header({}));
+    if (format == BIN) {
+        encoder = make_unique<bin_encoder>(mode != STREAM, mode == PROFILE, image_name,
+                                           image_build_id);
+        writer_start(format_bin, flush_ms, policy);
+    } else {
+        writer_start(format_csv, flush_ms, policy);
+    }
+    if (!insn_cache_init(info->target_name, backend_name, insn_cache_arg)) {
+        cout << "Could not read instruction cache " << insn_cache_arg << endl;
+        return -6;
+    }
+    if (scan) {
+        prescan_init(scan, info->target_name, backend_name, prescan_cache_arg);
+    }
+    if (known_arg && !known_edges_init(known_arg)) {
+        cout << "Could not read known edge database " << known_arg << endl;
+        return -7;
+    }
+
+    if (adaptive_arg) {
+        adaptive_init(adaptive, request_retranslation);
+    }
+
+#ifdef COND_CALLBACKS
+    // The scoreboard is never freed since vCPUs may still be running when the guest exits
+    pending_branch = qemu_plugin_scoreboard_u64(qemu_plugin_scoreboard_new(sizeof(uint64_t)));
+#endif
+    maps_init(info->target_name);
+    plugin_id = id;
+    register_callbacks(id);
 
     return 0;
 }
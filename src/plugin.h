@@ -0,0 +1,8 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+// QEMU reuses the indices of vCPUs that have exited so this bounds the number of guest threads
+// running at the same time rather than the total number of threads created
+static const unsigned int max_vcpus = 4096;
+
+#endif
@@ -0,0 +1,239 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "elf_file.h"
+#include "maps.h"
+#include "prescan.h"
+
+using namespace std;
+
+// The candidate bitmap of one executable segment. Bit i is set if the instruction at file offset
+// `offset + i` may be an indirect branch.
+typedef struct scanned_segment {
+    uint64_t offset;
+    uint64_t size;
+    vector<uint64_t> candidates;
+    // A read-only mapping of the segment's bytes used to check that translated instructions weren't
+    // modified since they were loaded. `code[0]` is the byte at `offset`.
+    const uint8_t *code;
+    void *mapping;
+    size_t mapping_size;
+} scanned_segment;
+
+typedef struct scanned_image {
+    size_t size;
+    vector<scanned_segment> segments;
+} scanned_image;
+
+static const char cache_file_magic[] = "ibresolver prescan 1";
+
+static is_indirect_branch_scan_fn scan_code = NULL;
+static string scan_arch;
+static string scan_backend;
+// Empty if bitmaps aren't saved
+static string cache_dir;
+
+// Scanned images indexed by image ID. NULL if the image wasn't looked up yet or couldn't be scanned
+// (e.g. anonymous mappings).
+static vector<unique_ptr<scanned_image>> images;
+static vector<bool> images_checked;
+// Translations are serialized by QEMU in user-mode so this is uncontended
+static mutex prescan_lock;
+
+void prescan_init(is_indirect_branch_scan_fn scan, const char *arch, const char *backend,
+                  const char *dir) {
+    scan_code = scan;
+    scan_arch = arch;
+    scan_backend = backend;
+    cache_dir = dir ? dir : "";
+}
+
+bool prescan_enabled() { return scan_code != NULL; }
+
+static string cache_path(const string &build_id) { return cache_dir + "/" + build_id + ".prescan"; }
+
+static bool load_bitmaps(const string &path, scanned_image &image) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    string magic, arch, backend, file_size;
+    getline(file, magic);
+    getline(file, arch);
+    getline(file, backend);
+    getline(file, file_size);
+    if ((magic != cache_file_magic) || (arch != scan_arch) || (backend != scan_backend) ||
+        (file_size != to_string(image.size))) {
+        return false;
+    }
+    uint64_t num_segments;
+    if (!file.read((char *)&num_segments, sizeof(num_segments))) {
+        return false;
+    }
+    for (uint64_t i = 0; i < num_segments; i++) {
+        scanned_segment segment = {};
+        if (!file.read((char *)&segment.offset, sizeof(segment.offset)) ||
+            !file.read((char *)&segment.size, sizeof(segment.size)) ||
+            (segment.offset > image.size) || (segment.size > image.size - segment.offset)) {
+            return false;
+        }
+        segment.candidates.resize((segment.size + 63) / 64);
+        if (!file.read((char *)segment.candidates.data(),
+                       segment.candidates.size() * sizeof(uint64_t))) {
+            return false;
+        }
+        image.segments.push_back(move(segment));
+    }
+    return true;
+}
+
+static void save_bitmaps(const string &path, const scanned_image &image) {
+    // Write to a temporary file and rename it so concurrent runs never see a partial bitmap
+    string tmp_path = path + ".tmp." + to_string(getpid());
+    ofstream file(tmp_path, ios::binary);
+    if (file.fail()) {
+        cout << "WARNING: Could not write pre-scan cache " << tmp_path << endl;
+        return;
+    }
+    file << cache_file_magic << "\n" << scan_arch << "\n" << scan_backend << "\n" << image.size
+         << "\n";
+    uint64_t num_segments = image.segments.size();
+    file.write((const char *)&num_segments, sizeof(num_segments));
+    for (const scanned_segment &segment : image.segments) {
+        file.write((const char *)&segment.offset, sizeof(segment.offset));
+        file.write((const char *)&segment.size, sizeof(segment.size));
+        file.write((const char *)segment.candidates.data(),
+                   segment.candidates.size() * sizeof(uint64_t));
+    }
+    file.close();
+    if (file.fail() || rename(tmp_path.c_str(), path.c_str())) {
+        cout << "WARNING: Could not write pre-scan cache " << path << endl;
+        remove(tmp_path.c_str());
+    }
+}
+
+// Map the bytes of each segment. Only the executable segments stay mapped rather than the whole
+// file, which may be much larger (e.g. with debug info).
+static bool map_segments(int fd, scanned_image &image) {
+    uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    for (scanned_segment &segment : image.segments) {
+        if (!segment.size) {
+            continue;
+        }
+        // mmap needs a page-aligned offset
+        uint64_t start = segment.offset & ~page_mask;
+        segment.mapping_size = segment.offset + segment.size - start;
+        void *data = mmap(NULL, segment.mapping_size, PROT_READ, MAP_PRIVATE, fd, start);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        segment.mapping = data;
+        segment.code = (const uint8_t *)data + (segment.offset - start);
+    }
+    return true;
+}
+
+static void unmap_segments(scanned_image &image) {
+    for (scanned_segment &segment : image.segments) {
+        if (segment.mapping) {
+            munmap(segment.mapping, segment.mapping_size);
+        }
+    }
+}
+
+// Load or compute the candidate bitmaps of an image's executable segments and map their bytes
+static unique_ptr<scanned_image> scan_image(uint32_t image_id) {
+    const string &path = image_name(image_id);
+    if (path[0] != '/') {
+        return NULL;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size <= 0)) {
+        close(fd);
+        return NULL;
+    }
+    auto image = make_unique<scanned_image>();
+    image->size = st.st_size;
+
+    const string &build_id = image_build_id(image_id);
+    bool cacheable = !cache_dir.empty() && !build_id.empty();
+    bool loaded = cacheable && load_bitmaps(cache_path(build_id), *image);
+    if (!loaded) {
+        image->segments.clear();
+        for (const elf_segment &segment : elf_executable_segments(path)) {
+            // Start at a 4-byte aligned offset so the backend knows which offsets are aligned
+            uint64_t start = segment.offset & ~3ULL;
+            scanned_segment scanned = {
+                .offset = start,
+                .size = segment.offset + segment.size - start,
+                .candidates = {},
+                .code = NULL,
+                .mapping = NULL,
+                .mapping_size = 0,
+            };
+            scanned.candidates.resize((scanned.size + 63) / 64);
+            image->segments.push_back(move(scanned));
+        }
+    }
+    bool mapped = map_segments(fd, *image);
+    close(fd);
+    if (!mapped) {
+        unmap_segments(*image);
+        return NULL;
+    }
+    if (!loaded) {
+        for (scanned_segment &segment : image->segments) {
+            if (segment.code) {
+                scan_code(segment.code, segment.size, segment.candidates.data());
+            }
+        }
+        if (cacheable) {
+            save_bitmaps(cache_path(build_id), *image);
+        }
+    }
+    return image;
+}
+
+bool prescan_rules_out(const image_offset &offset, const uint8_t *insn_data, size_t insn_size) {
+    lock_guard<mutex> guard(prescan_lock);
+    uint32_t id = offset.image;
+    if (id >= images.size()) {
+        images.resize(id + 1);
+        images_checked.resize(id + 1);
+    }
+    if (!images_checked[id]) {
+        images_checked[id] = true;
+        images[id] = scan_image(id);
+    }
+    const scanned_image *image = images[id].get();
+    if (!image) {
+        return false;
+    }
+    uint64_t pos = offset.offset;
+    for (const scanned_segment &segment : image->segments) {
+        if ((pos < segment.offset) || (pos - segment.offset >= segment.size)) {
+            continue;
+        }
+        uint64_t i = pos - segment.offset;
+        if ((insn_size > segment.size - i) || memcmp(segment.code + i, insn_data, insn_size)) {
+            return false;
+        }
+        return !(segment.candidates[i / 64] & (1ULL << (i % 64)));
+    }
+    return false;
+}
@@ -0,0 +1,28 @@
+#ifndef PRESCAN_H
+#define PRESCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "maps.h"
+
+// Sets bit i of `candidates` for each offset i in `code` which may be the start of an indirect
+// branch. See `is_indirect_branch_scan` in the README.
+typedef void (*is_indirect_branch_scan_fn)(const uint8_t *code, size_t size, uint64_t *candidates);
+
+// Enable scanning the executable segments of each ELF file the first time code from it is
+// translated. The result is a bitmap of the offsets that may be indirect branches so instructions
+// at other offsets don't need to be classified by the backend. If `cache_dir` is not NULL bitmaps
+// are saved to and loaded from that directory, keyed by build ID, `arch` and `backend`.
+void prescan_init(is_indirect_branch_scan_fn scan, const char *arch, const char *backend,
+                  const char *cache_dir);
+
+// Whether `prescan_init` was called
+bool prescan_enabled();
+
+// Checks if the pre-scan found that the instruction loaded from `offset` can't be an indirect
+// branch. Returns false if the instruction may be a branch, isn't in an executable segment of an ELF
+// file or doesn't have the same bytes as the file (e.g. it was modified at runtime).
+bool prescan_rules_out(const image_offset &offset, const uint8_t *insn_data, size_t insn_size);
+
+#endif
@@ -0,0 +1,61 @@
+#include <time.h>
+
+#include <atomic>
+
+#include "sampler.h"
+
+using namespace std;
+
+static const size_t initial_slots = 256;
+
+static sampling_config config = {.period = 1, .first = 0, .budget = 0};
+
+// The second the budget is currently being spent in and how much of it is used
+static atomic<uint64_t> budget_second(0);
+static atomic<uint64_t> budget_used(0);
+
+void sampler_init(const sampling_config &new_config) { config = new_config; }
+
+sampler::sampler(unsigned int vcpu_idx)
+    : period(config.period),
+      first_limit(config.first ? config.first : UINT64_MAX),
+      budget(config.budget),
+      slots(initial_slots, {.callsite_vaddr = UINT64_MAX, .executions = 0, .next_sample = 0}),
+      num_callsites(0),
+      drops({}),
+      // xorshift64 needs a nonzero state which the odd multiplier preserves
+      rng((vcpu_idx + 1) * 0x9e3779b97f4a7c15ULL) {}
+
+sampler::callsite_count &sampler::insert(uint64_t callsite_vaddr) {
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if (2 * (num_callsites + 1) > slots.size()) {
+        vector<callsite_count> old_slots(2 * slots.size(),
+                                         {.callsite_vaddr = UINT64_MAX, .executions = 0,
+                                          .next_sample = 0});
+        old_slots.swap(slots);
+        for (const callsite_count &c : old_slots) {
+            if (c.callsite_vaddr != UINT64_MAX) {
+                slots[probe(c.callsite_vaddr)] = c;
+            }
+        }
+    }
+    num_callsites++;
+    callsite_count &c = slots[probe(callsite_vaddr)];
+    c = {.callsite_vaddr = callsite_vaddr, .executions = 0, .next_sample = 0};
+    return c;
+}
+
+bool sampler::take_budget() {
+    // The coarse clock is read from the vDSO without a syscall
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t second = now.tv_sec;
+    uint64_t current = budget_second.load(memory_order_relaxed);
+    // The first vCPU to see a new second resets the budget. Racing vCPUs may spend a few edges
+    // against the wrong second which is fine for rate limiting.
+    if ((second != current) &&
+        budget_second.compare_exchange_strong(current, second, memory_order_relaxed)) {
+        budget_used.store(0, memory_order_relaxed);
+    }
+    return budget_used.fetch_add(1, memory_order_relaxed) < config.budget;
+}
@@ -0,0 +1,117 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Which taken edges are recorded. The policies can be combined and an edge is only recorded if
+// all of them keep it.
+typedef struct sampling_config {
+    // Record one of every `period` executions of each callsite on average, starting with the first
+    // one
+    uint64_t period;
+    // Only record the first `first` executions of each callsite. Zero means no limit.
+    uint64_t first;
+    // Record at most `budget` edges per second across all vCPUs. Zero means no limit.
+    uint64_t budget;
+} sampling_config;
+
+// The number of taken edges each policy didn't record
+typedef struct sampling_drops {
+    uint64_t period;
+    uint64_t first;
+    uint64_t budget;
+} sampling_drops;
+
+// Set the policies used by all samplers. Must be called before any sampler is created.
+void sampler_init(const sampling_config &config);
+
+// Decides which edges taken by one vCPU are recorded. Callsite execution counts are kept per vCPU
+// so the `first` limit applies to each vCPU separately.
+class sampler {
+   public:
+    // The random gaps are seeded from the vCPU index so vCPUs running the same code don't sample
+    // the same executions
+    explicit sampler(unsigned int vcpu_idx);
+
+    // Checks if an edge from `callsite_vaddr` should be recorded, counting it as dropped if not
+    bool keep(uint64_t callsite_vaddr) {
+        callsite_count &c = find_or_insert(callsite_vaddr);
+        uint64_t n = c.executions++;
+        if (n >= first_limit) {
+            drops.first++;
+            return false;
+        }
+        if (n != c.next_sample) {
+            drops.period++;
+            return false;
+        }
+        c.next_sample += next_gap();
+        if (budget && !take_budget()) {
+            drops.budget++;
+            return false;
+        }
+        return true;
+    }
+
+    const sampling_drops &dropped() const { return drops; }
+
+   private:
+    typedef struct callsite_count {
+        // All-ones for unused slots
+        uint64_t callsite_vaddr;
+        uint64_t executions;
+        // The execution to record next
+        uint64_t next_sample;
+    } callsite_count;
+
+    // Get the index of the slot holding the callsite or of the empty slot it would be inserted in
+    size_t probe(uint64_t callsite_vaddr) const {
+        size_t mask = slots.size() - 1;
+        // Instructions are at least 2-byte aligned on arm
+        size_t i = (((callsite_vaddr >> 1) * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+        // Linear probing
+        while ((slots[i].callsite_vaddr != callsite_vaddr) &&
+               (slots[i].callsite_vaddr != UINT64_MAX)) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    callsite_count &find_or_insert(uint64_t callsite_vaddr) {
+        size_t i = probe(callsite_vaddr);
+        if (slots[i].callsite_vaddr == callsite_vaddr) {
+            return slots[i];
+        }
+        return insert(callsite_vaddr);
+    }
+
+    // The number of executions until the next one recorded. Gaps are random with a mean of
+    // `period` so that callsites alternating between destinations aren't sampled with a bias.
+    uint64_t next_gap() {
+        if (period == 1) {
+            return 1;
+        }
+        // xorshift64
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return 1 + rng % (2 * period - 1);
+    }
+
+    callsite_count &insert(uint64_t callsite_vaddr);
+    static bool take_budget();
+
+    // Copied from the config so the fast path doesn't need to check for "no limit"
+    uint64_t period;
+    uint64_t first_limit;
+    uint64_t budget;
+    // The number of slots is always a power of two
+    std::vector<callsite_count> slots;
+    size_t num_callsites;
+    sampling_drops drops;
+    uint64_t rng;
+};
+
+#endif
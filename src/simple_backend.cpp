@@ -1,76 +1,385 @@
 #include <string>
 #include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "arm_state.h"
+#include "builtin_backend.h"
 
 using namespace std;
 
-static string arch = "";
+// An instruction encoding. An instruction matches if `(insn & mask) == value`.
+typedef struct opcode_pattern {
+    uint32_t mask;
+    uint32_t value;
+    ibresolver_branch_kind kind;
+} opcode_pattern;
 
-extern "C" bool arch_supported_default_impl(const char *arch_name) {
-    if (strcmp(arch_name, "arm") && strcmp(arch_name, "x86_64")) {
-        return false;
+// Get the kind of the first pattern the instruction matches, so more specific patterns must come
+// first
+template <size_t N>
+static ibresolver_branch_kind match_kind(const opcode_pattern (&patterns)[N], uint32_t insn) {
+    for (const opcode_pattern &p : patterns) {
+        if ((insn & p.mask) == p.value) {
+            return p.kind;
+        }
     }
-    arch = string(arch_name);
-    return true;
+    return IBRESOLVER_NOT_BRANCH;
 }
 
-extern "C" bool is_indirect_branch_default_impl(uint8_t *insn_data, size_t insn_size) {
-    if (!arch.compare("arm")) {
-        if (insn_size == 4) {
-            // Check for the A1 encoding (ARM) of blx with a register argument
-            // TODO: This function should track ARM/THUMB state rather than assume that all 4-byte
-            // instructions are in ARM mode. If the A1 encoding of blx with a register argument
-            // happens to match a THUMB instruction it'll get marked as a potential indirect branch.
-            // The incorrectly marked instruction won't give incorrect results since QEMU will just
-            // execute the next instruction and the plugin will mark it as an untaken indirect
-            // branch which is omitted in the output. It may cause the plugin to print spurious
-            // warnings about consecutive indirect branches not being handled properly though.
-            const uint32_t blx_variable_bits = 0xf000000f;
-            const uint32_t blx_constant_bits = 0x012fff30;
-            // Arbitrarily set all variable bits in the blx instruction before comparing with the
-            // input instruction
-            const uint32_t blx = blx_constant_bits | blx_variable_bits;
-            uint32_t b0 = insn_data[0];
-            uint32_t b1 = insn_data[1];
-            uint32_t b2 = insn_data[2];
-            uint32_t b3 = insn_data[3];
-            uint32_t word = b0 | (b1 << 8) | (b2 << 16) | (b3 << 24);
-            // Set all variable bits in the instruction
-            word |= blx_variable_bits;
-            if (word == blx) {
-                return true;
-            }
-        } else if (insn_size == 2) {
-            // Check for the T1 encoding (THUMB) of blx with a register argument
-            const uint16_t blx_variable_bits = 0x0078;
-            const uint16_t blx_constant_bits = 0x4780;
-            const uint16_t blx = blx_constant_bits | blx_variable_bits;
-            uint16_t b0 = insn_data[0];
-            uint16_t b1 = insn_data[1];
-            uint16_t half_word = b0 | (b1 << 8);
-            // Set all variable bits in the instruction
-            half_word |= blx_variable_bits;
-            if (half_word == blx) {
-                return true;
-            }
+// Indirect branches in the ARM instruction set (A1 encodings). The condition field is masked out and
+// checked separately. All of them may switch to THUMB.
+static const opcode_pattern arm_branches[] = {
+    // bx lr
+    {0x0fffffff, 0x012fff1e, IBRESOLVER_BRANCH_RETURN},
+    // bx rm
+    {0x0ffffff0, 0x012fff10, IBRESOLVER_BRANCH_JUMP},
+    // blx rm
+    {0x0ffffff0, 0x012fff30, IBRESOLVER_BRANCH_CALL},
+    // mov pc, lr
+    {0x0fefffff, 0x01a0f00e, IBRESOLVER_BRANCH_RETURN},
+    // mov pc, rm
+    {0x0feffff0, 0x01a0f000, IBRESOLVER_BRANCH_JUMP},
+    // add pc, rn, rm{, shift}
+    {0x0fe0f010, 0x0080f000, IBRESOLVER_BRANCH_JUMP},
+    // ldr pc, [sp, #imm] (including pop {pc})
+    {0x0e5ff000, 0x041df000, IBRESOLVER_BRANCH_RETURN},
+    // ldr pc, [rn, #imm]
+    {0x0e50f000, 0x0410f000, IBRESOLVER_BRANCH_JUMP},
+    // ldr pc, [rn, rm{, shift}]
+    {0x0e50f010, 0x0610f000, IBRESOLVER_BRANCH_JUMP},
+    // ldm sp{!}, {..., pc} (including pop {..., pc})
+    {0x0e1f8000, 0x081d8000, IBRESOLVER_BRANCH_RETURN},
+    // ldm rn{!}, {..., pc}
+    {0x0e108000, 0x08108000, IBRESOLVER_BRANCH_JUMP},
+};
+
+// Indirect branches in the 16-bit THUMB instructions. Only interworking branches may switch to ARM.
+static const opcode_pattern thumb16_branches[] = {
+    // bx lr
+    {0xffff, 0x4770, IBRESOLVER_BRANCH_RETURN | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // bx rm
+    {0xff87, 0x4700, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // blx rm
+    {0xff87, 0x4780, IBRESOLVER_BRANCH_CALL | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // mov pc, rm
+    {0xff87, 0x4687, IBRESOLVER_BRANCH_JUMP},
+    // add pc, rm
+    {0xff87, 0x4487, IBRESOLVER_BRANCH_JUMP},
+    // pop {..., pc}
+    {0xff00, 0xbd00, IBRESOLVER_BRANCH_RETURN | IBRESOLVER_BRANCH_MODE_SWITCH},
+};
+
+// Indirect branches in the 32-bit THUMB instructions. Here the first halfword is in the upper 16
+// bits.
+static const opcode_pattern thumb32_branches[] = {
+    // ldr.w pc, [rn, #imm12]
+    {0xfff0f000, 0xf8d0f000, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // pop.w {pc}, i.e. ldr pc, [sp], #4
+    {0xfffff800, 0xf85df800, IBRESOLVER_BRANCH_RETURN | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // ldr pc, [rn, #-imm8] and the pre/post-indexed forms
+    {0xfff0f800, 0xf850f800, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // ldr.w pc, [rn, rm{, lsl #imm2}]
+    {0xfff0ffc0, 0xf850f000, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // ldr.w pc, [pc, #imm12]
+    {0xff7ff000, 0xf85ff000, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // pop.w {..., pc}, i.e. ldmia.w sp{!}, {..., pc}
+    {0xffdf8000, 0xe89d8000, IBRESOLVER_BRANCH_RETURN | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // ldmia.w rn{!}, {..., pc}
+    {0xffd08000, 0xe8908000, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // ldmdb rn{!}, {..., pc}
+    {0xffd08000, 0xe9108000, IBRESOLVER_BRANCH_JUMP | IBRESOLVER_BRANCH_MODE_SWITCH},
+    // tbb/tbh [rn, rm]
+    {0xfff0ffe0, 0xe8d0f000, IBRESOLVER_BRANCH_JUMP},
+};
+
+// An x86 instruction is identified by its opcode and the reg field of its ModRM byte
+typedef struct x86_pattern {
+    uint8_t opcode;
+    uint8_t modrm_mask;
+    uint8_t modrm_value;
+    ibresolver_branch_kind kind;
+} x86_pattern;
+
+static const x86_pattern x86_branches[] = {
+    // call r/m64 (e.g. callq *%rax, callq *0x8(%rax))
+    {0xff, 0x38, 0x10, IBRESOLVER_BRANCH_CALL},
+    // call m16:32 (far call)
+    {0xff, 0x38, 0x18, IBRESOLVER_BRANCH_CALL},
+    // jmp r/m64 (e.g. jmpq *%rax, jmpq *0x10(%rip))
+    {0xff, 0x38, 0x20, IBRESOLVER_BRANCH_JUMP},
+    // jmp m16:32 (far jmp)
+    {0xff, 0x38, 0x28, IBRESOLVER_BRANCH_JUMP},
+};
+
+static uint16_t read_u16(const uint8_t *data) { return data[0] | (data[1] << 8); }
+
+static uint32_t read_u32(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static ibresolver_branch_kind arm_branch_kind(const uint8_t *insn_data) {
+    uint32_t word = read_u32(insn_data);
+    uint32_t cond = word >> 28;
+    // Condition code 0b1111 is the unconditional instruction space which has no indirect branches
+    // (blx with an immediate is a direct call)
+    if (cond == 0xf) {
+        return IBRESOLVER_NOT_BRANCH;
+    }
+    ibresolver_branch_kind kind = match_kind(arm_branches, word);
+    if (kind == IBRESOLVER_NOT_BRANCH) {
+        return kind;
+    }
+    kind |= IBRESOLVER_BRANCH_MODE_SWITCH;
+    // Anything but "always" (0b1110) may fall through
+    if (cond != 0xe) {
+        kind |= IBRESOLVER_BRANCH_CONDITIONAL;
+    }
+    return kind;
+}
+
+static bool is_arm_branch(const uint8_t *insn_data) {
+    return arm_branch_kind(insn_data) != IBRESOLVER_NOT_BRANCH;
+}
+
+// THUMB branches are always reported as conditional since they may be in an IT block. The IT
+// instruction may be in an earlier block so the surrounding instructions can't rule it out.
+static ibresolver_branch_kind thumb_branch_kind(const uint8_t *insn_data, size_t insn_size) {
+    ibresolver_branch_kind kind = IBRESOLVER_NOT_BRANCH;
+    if (insn_size == 2) {
+        kind = match_kind(thumb16_branches, read_u16(insn_data));
+    } else if (insn_size == 4) {
+        uint32_t word = (read_u16(insn_data) << 16) | read_u16(insn_data + 2);
+        kind = match_kind(thumb32_branches, word);
+    }
+    if (kind == IBRESOLVER_NOT_BRANCH) {
+        return kind;
+    }
+    return kind | IBRESOLVER_BRANCH_CONDITIONAL;
+}
+
+static bool is_thumb_branch(const uint8_t *insn_data, size_t insn_size) {
+    return thumb_branch_kind(insn_data, insn_size) != IBRESOLVER_NOT_BRANCH;
+}
+
+// The last instruction set seen in each page of code. Blocks that don't reveal which instruction
+// set they use fall back to the state of their page. QEMU serializes translations in user-mode so
+// this doesn't need a lock.
+static unordered_map<uint64_t, arm_state> page_states;
+
+static const int page_bits = 12;
+
+static ibresolver_branch_kind arm_indirect_branch_kind(const uint8_t *insn_data,
+                                                       size_t insn_size) {
+    if (insn_size == 2) {
+        return thumb_branch_kind(insn_data, insn_size);
+    }
+    // Without the context of the surrounding instructions assume 4-byte instructions are in ARM mode
+    if (insn_size == 4) {
+        return arm_branch_kind(insn_data);
+    }
+    return IBRESOLVER_NOT_BRANCH;
+}
+
+static void arm_indirect_branch_kinds(const ibresolver_insn *insns, size_t num_insns,
+                                      ibresolver_branch_kind *results) {
+    if (num_insns == 0) {
+        return;
+    }
+    uint64_t page = insns[0].vaddr >> page_bits;
+    arm_state state = infer_arm_state(insns, num_insns);
+    if (state == UNKNOWN_STATE) {
+        auto it = page_states.find(page);
+        state = (it != page_states.end()) ? it->second : ARM_STATE;
+    } else {
+        page_states[page] = state;
+    }
+    for (size_t i = 0; i < num_insns; i++) {
+        if (state == THUMB_STATE) {
+            results[i] = thumb_branch_kind(insns[i].data, insns[i].size);
+        } else {
+            results[i] = (insns[i].size == 4) ? arm_branch_kind(insns[i].data)
+                                               : IBRESOLVER_NOT_BRANCH;
+        }
+    }
+}
+
+// Legacy and REX prefixes that may precede an indirect call or jmp (e.g. `notrack` (0x3e) and `bnd`
+// (0xf2) from CET and MPX)
+static bool is_x86_prefix(uint8_t byte) {
+    switch (byte) {
+        case 0x26:
+        case 0x2e:
+        case 0x36:
+        case 0x3e:
+        case 0x64:
+        case 0x65:
+        case 0x66:
+        case 0x67:
+        case 0xf2:
+        case 0xf3:
+            return true;
+        default:
+            return (byte & 0xf0) == 0x40;
+    }
+}
+
+// x86-64 has no conditional indirect branches
+static ibresolver_branch_kind x86_64_indirect_branch_kind(const uint8_t *insn_data,
+                                                          size_t insn_size) {
+    size_t i = 0;
+    while ((i < insn_size) && is_x86_prefix(insn_data[i])) {
+        i++;
+    }
+    if (i + 1 >= insn_size) {
+        return IBRESOLVER_NOT_BRANCH;
+    }
+    uint8_t opcode = insn_data[i];
+    uint8_t modrm = insn_data[i + 1];
+    for (const x86_pattern &p : x86_branches) {
+        if ((opcode == p.opcode) && ((modrm & p.modrm_mask) == p.modrm_value)) {
+            return p.kind;
+        }
+    }
+    return IBRESOLVER_NOT_BRANCH;
+}
+
+static bool is_x86_64_indirect_branch(const uint8_t *insn_data, size_t insn_size) {
+    return x86_64_indirect_branch_kind(insn_data, insn_size) != IBRESOLVER_NOT_BRANCH;
+}
+
+static void x86_64_indirect_branch_kinds(const ibresolver_insn *insns, size_t num_insns,
+                                         ibresolver_branch_kind *results) {
+    for (size_t i = 0; i < num_insns; i++) {
+        results[i] = x86_64_indirect_branch_kind(insns[i].data, insns[i].size);
+    }
+}
+
+static void set_candidate(uint64_t *candidates, size_t offset) {
+    candidates[offset / 64] |= 1ULL << (offset % 64);
+}
+
+// Both ARM and THUMB branches are marked at every even offset since the instruction set of a
+// segment isn't known ahead of time
+static void arm_indirect_branch_scan(const uint8_t *code, size_t size, uint64_t *candidates) {
+    for (size_t i = 0; i + 2 <= size; i += 2) {
+        bool candidate = is_thumb_branch(code + i, 2);
+        if (i + 4 <= size) {
+            uint32_t thumb32 = (read_u16(code + i) << 16) | read_u16(code + i + 2);
+            candidate |= match_kind(thumb32_branches, thumb32) != IBRESOLVER_NOT_BRANCH;
+            candidate |= is_arm_branch(code + i);
         }
-    } else if (!arch.compare("x86_64")) {
-        // Handles callq rax, rcx, rdx, etc.
-        if (insn_size == 2) {
-            uint8_t b0 = insn_data[0];
-            uint8_t b1 = insn_data[1];
-            if ((b0 == 0xff) && (0xd0 <= b1) && (b1 <= 0xd6)) {
-                return true;
-            }
+        if (candidate) {
+            set_candidate(candidates, i);
         }
-        // Handles callq r8, r9, r10, etc.
-        if (insn_size == 3) {
-            uint8_t b0 = insn_data[0];
-            uint8_t b1 = insn_data[1];
-            uint8_t b2 = insn_data[2];
-            if ((b0 == 0x41) && (b1 == 0xff) && (0xd0 <= b2) && (b2 <= 0xd6)) {
-                return true;
-            }
+    }
+}
+
+// Mark an 0xff opcode at `i` if it's an indirect call or jmp along with the prefixes before it
+static void mark_x86_candidate(const uint8_t *code, size_t size, size_t i, uint64_t *candidates) {
+    if (!is_x86_64_indirect_branch(code + i, size - i)) {
+        return;
+    }
+    set_candidate(candidates, i);
+    // Instructions are at most 15 bytes so at most 13 prefixes can precede the opcode and ModRM
+    for (size_t n = 1; (n <= 13) && (n <= i) && is_x86_prefix(code[i - n]); n++) {
+        set_candidate(candidates, i - n);
+    }
+}
+
+// Every indirect call and jmp has an 0xff opcode byte so only the offsets around those bytes are
+// decoded
+static void x86_64_indirect_branch_scan(const uint8_t *code, size_t size, uint64_t *candidates) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i opcode = _mm_set1_epi8((char)0xff);
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(code + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, opcode));
+        while (mask) {
+            mark_x86_candidate(code, size, i + __builtin_ctz(mask), candidates);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < size; i++) {
+        if (code[i] == 0xff) {
+            mark_x86_candidate(code, size, i, candidates);
         }
     }
+}
+
+static ibresolver_branch_kind unsupported_indirect_branch_kind(const uint8_t *insn_data,
+                                                               size_t insn_size) {
+    return IBRESOLVER_NOT_BRANCH;
+}
+
+static void unsupported_indirect_branch_kinds(const ibresolver_insn *insns, size_t num_insns,
+                                              ibresolver_branch_kind *results) {
+    memset(results, IBRESOLVER_NOT_BRANCH, num_insns * sizeof(ibresolver_branch_kind));
+}
+
+static void unsupported_indirect_branch_scan(const uint8_t *code, size_t size,
+                                             uint64_t *candidates) {}
+
+// The decoders for the architecture passed to `arch_supported_default_impl`
+static ibresolver_branch_kind (*decode_insn)(const uint8_t *, size_t) =
+    unsupported_indirect_branch_kind;
+static void (*decode_block)(const ibresolver_insn *, size_t, ibresolver_branch_kind *) =
+    unsupported_indirect_branch_kinds;
+static void (*scan_code)(const uint8_t *, size_t, uint64_t *) = unsupported_indirect_branch_scan;
+
+extern "C" bool arch_supported_default_impl(const char *arch_name) {
+    if (!strcmp(arch_name, "arm")) {
+        decode_insn = arm_indirect_branch_kind;
+        decode_block = arm_indirect_branch_kinds;
+        scan_code = arm_indirect_branch_scan;
+        return true;
+    }
+    if (!strcmp(arch_name, "x86_64")) {
+        decode_insn = x86_64_indirect_branch_kind;
+        decode_block = x86_64_indirect_branch_kinds;
+        scan_code = x86_64_indirect_branch_scan;
+        return true;
+    }
     return false;
 }
+
+extern "C" bool is_indirect_branch_default_impl(uint8_t *insn_data, size_t insn_size) {
+    return decode_insn(insn_data, insn_size) != IBRESOLVER_NOT_BRANCH;
+}
+
+extern "C" uint32_t is_indirect_branch_batch_version_default_impl(void) {
+    return IBRESOLVER_BATCH_ABI_VERSION;
+}
+
+extern "C" void is_indirect_branch_batch_default_impl(const ibresolver_insn *insns,
+                                                      size_t num_insns, bool *results) {
+    vector<ibresolver_branch_kind> kinds(num_insns);
+    decode_block(insns, num_insns, kinds.data());
+    for (size_t i = 0; i < num_insns; i++) {
+        results[i] = kinds[i] != IBRESOLVER_NOT_BRANCH;
+    }
+}
+
+extern "C" uint32_t is_indirect_branch_scan_version_default_impl(void) {
+    return IBRESOLVER_SCAN_ABI_VERSION;
+}
+
+extern "C" void is_indirect_branch_scan_default_impl(const uint8_t *code, size_t size,
+                                                     uint64_t *candidates) {
+    scan_code(code, size, candidates);
+}
+
+extern "C" uint32_t indirect_branch_kinds_version_default_impl(void) {
+    return IBRESOLVER_KIND_ABI_VERSION;
+}
+
+extern "C" void indirect_branch_kinds_default_impl(const ibresolver_insn *insns, size_t num_insns,
+                                                   ibresolver_branch_kind *results) {
+    decode_block(insns, num_insns, results);
+}
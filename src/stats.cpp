@@ -0,0 +1,164 @@
+#include <fstream>
+#include <iostream>
+
+#include "stats.h"
+
+using namespace std;
+
+bool stats_enabled = false;
+vcpu_counters stats_vcpus[max_vcpus + 1];
+thread_local unsigned int stats_thread_vcpu = stats_shared_slot;
+
+// Used to calibrate ticks against wall-clock time
+static uint64_t start_ticks;
+static chrono::steady_clock::time_point start_time;
+
+static const char *callback_names[NUM_CALLBACKS] = {
+    "branch_taken",
+    "branch_skipped",
+    "indirect_branch_exec",
+    "indirect_branch_at_start",
+    "branch_filtered",
+};
+
+void stats_init() {
+    stats_enabled = true;
+    start_ticks = stats_now();
+    start_time = chrono::steady_clock::now();
+}
+
+// Add to one of the calling thread's counters
+static void add(atomic<uint64_t> &count, uint64_t n) {
+    if (stats_thread_vcpu == stats_shared_slot) {
+        count.fetch_add(n, memory_order_relaxed);
+    } else {
+        count.store(count.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+void stats_count_translation(size_t num_insns, size_t num_classified, uint64_t ticks) {
+    if (!stats_enabled) {
+        return;
+    }
+    vcpu_counters &vcpu = stats_vcpus[stats_thread_vcpu];
+    add(vcpu.translations, 1);
+    add(vcpu.insns_translated, num_insns);
+    add(vcpu.insns_classified, num_classified);
+    add(vcpu.backend_ticks, ticks);
+}
+
+void stats_count_maps_lookup(uint64_t ticks, bool reparsed) {
+    if (!stats_enabled) {
+        return;
+    }
+    vcpu_counters &vcpu = stats_vcpus[stats_thread_vcpu];
+    add(vcpu.maps_lookups, 1);
+    if (reparsed) {
+        add(vcpu.maps_reparses, 1);
+    }
+    add(vcpu.maps_ticks, ticks);
+    int bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+    if (bucket >= num_latency_buckets) {
+        bucket = num_latency_buckets - 1;
+    }
+    add(vcpu.maps_latency[bucket], 1);
+}
+
+void stats_count_bytes_written(size_t bytes) {
+    if (stats_enabled) {
+        add(stats_vcpus[stats_thread_vcpu].bytes_written, bytes);
+    }
+}
+
+// Sum one of the counters of every vCPU
+static uint64_t total(atomic<uint64_t> vcpu_counters::*counter) {
+    uint64_t sum = 0;
+    for (const vcpu_counters &vcpu : stats_vcpus) {
+        sum += (vcpu.*counter).load(memory_order_relaxed);
+    }
+    return sum;
+}
+
+void stats_report(const char *json_path) {
+    double elapsed_ns =
+        chrono::duration<double, nano>(chrono::steady_clock::now() - start_time).count();
+    uint64_t elapsed_ticks = stats_now() - start_ticks;
+    double ns_per_tick = elapsed_ticks ? elapsed_ns / elapsed_ticks : 1.0;
+
+    uint64_t callbacks[NUM_CALLBACKS] = {};
+    uint64_t maps_latency[num_latency_buckets] = {};
+    for (const vcpu_counters &vcpu : stats_vcpus) {
+        for (int i = 0; i < NUM_CALLBACKS; i++) {
+            callbacks[i] += vcpu.callbacks[i].load(memory_order_relaxed);
+        }
+        for (int i = 0; i < num_latency_buckets; i++) {
+            maps_latency[i] += vcpu.maps_latency[i].load(memory_order_relaxed);
+        }
+    }
+    uint64_t translations = total(&vcpu_counters::translations);
+    uint64_t insns_translated = total(&vcpu_counters::insns_translated);
+    uint64_t insns_classified = total(&vcpu_counters::insns_classified);
+    uint64_t backend_ticks = total(&vcpu_counters::backend_ticks);
+    uint64_t lookups = total(&vcpu_counters::maps_lookups);
+    uint64_t maps_reparses = total(&vcpu_counters::maps_reparses);
+    uint64_t maps_ticks = total(&vcpu_counters::maps_ticks);
+    uint64_t bytes_written = total(&vcpu_counters::bytes_written);
+    double backend_ms = backend_ticks * ns_per_tick / 1e6;
+    double maps_ms = maps_ticks * ns_per_tick / 1e6;
+
+    cout << "ibresolver stats:" << endl;
+    cout << "  run time: " << elapsed_ns / 1e6 << " ms" << endl;
+    cout << "  translations: " << translations << " blocks, " << insns_translated
+         << " instructions" << endl;
+    cout << "  backend: " << insns_classified << " instructions classified in "
+         << backend_ms << " ms" << endl;
+    for (int i = 0; i < NUM_CALLBACKS; i++) {
+        cout << "  " << callback_names[i] << ": " << callbacks[i] << " calls" << endl;
+    }
+    cout << "  maps lookups: " << lookups << " (" << maps_reparses << " re-parses) in "
+         << maps_ms << " ms" << endl;
+    for (int i = 0; i < num_latency_buckets; i++) {
+        uint64_t count = maps_latency[i];
+        if (count) {
+            cout << "    < " << (uint64_t)((2ULL << i) * ns_per_tick) << " ns: " << count << endl;
+        }
+    }
+    cout << "  bytes written: " << bytes_written << endl;
+
+    if (!json_path) {
+        return;
+    }
+    ofstream json(json_path);
+    if (json.fail()) {
+        cout << "ERROR: Could not write stats to " << json_path << endl;
+        return;
+    }
+    json << "{\n";
+    json << "  \"run_ns\": " << (uint64_t)elapsed_ns << ",\n";
+    json << "  \"translations\": " << translations << ",\n";
+    json << "  \"insns_translated\": " << insns_translated << ",\n";
+    json << "  \"insns_classified\": " << insns_classified << ",\n";
+    json << "  \"backend_ns\": " << (uint64_t)(backend_ticks * ns_per_tick) << ",\n";
+    json << "  \"callbacks\": {";
+    for (int i = 0; i < NUM_CALLBACKS; i++) {
+        json << (i ? ", " : "") << "\"" << callback_names[i] << "\": " << callbacks[i];
+    }
+    json << "},\n";
+    json << "  \"maps_lookups\": " << lookups << ",\n";
+    json << "  \"maps_reparses\": " << maps_reparses << ",\n";
+    json << "  \"maps_ns\": " << (uint64_t)(maps_ticks * ns_per_tick) << ",\n";
+    // Pairs of the bucket's upper bound in ns and the number of lookups in the bucket
+    json << "  \"maps_latency_ns\": [";
+    bool first = true;
+    for (int i = 0; i < num_latency_buckets; i++) {
+        uint64_t count = maps_latency[i];
+        if (count) {
+            json << (first ? "" : ", ") << "[" << (uint64_t)((2ULL << i) * ns_per_tick) << ", "
+                 << count << "]";
+            first = false;
+        }
+    }
+    json << "],\n";
+    json << "  \"bytes_written\": " << bytes_written << "\n";
+    json << "}\n";
+}
@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "plugin.h"
+
+// Counters for profiling the plugin itself, enabled by the `stats` argument. Everything here is a
+// no-op unless `stats_enabled` is set so the counters cost a predictable branch when disabled.
+
+typedef enum stats_callback {
+    BRANCH_TAKEN,
+    BRANCH_SKIPPED,
+    INDIRECT_BRANCH_EXEC,
+    INDIRECT_BRANCH_AT_START,
+    BRANCH_FILTERED,
+    NUM_CALLBACKS,
+} stats_callback;
+
+// The number of power of two buckets in the maps lookup latency histogram
+static const int num_latency_buckets = 32;
+
+// Counters for one vCPU. These are only incremented by the vCPU's thread so they use relaxed loads
+// and stores rather than atomic read-modify-writes, and each vCPU's counters start on their own
+// cache line.
+typedef struct alignas(64) vcpu_counters {
+    std::atomic<uint64_t> callbacks[NUM_CALLBACKS];
+    std::atomic<uint64_t> translations;
+    std::atomic<uint64_t> insns_translated;
+    std::atomic<uint64_t> insns_classified;
+    std::atomic<uint64_t> backend_ticks;
+    std::atomic<uint64_t> maps_lookups;
+    std::atomic<uint64_t> maps_reparses;
+    std::atomic<uint64_t> maps_ticks;
+    // Bucket `i` counts lookups taking less than 2^(i + 1) ticks
+    std::atomic<uint64_t> maps_latency[num_latency_buckets];
+    std::atomic<uint64_t> bytes_written;
+} vcpu_counters;
+
+// The counters of threads that haven't run an execution callback yet, i.e. the writer thread and
+// vCPU threads translating their first blocks. Several threads may share these so they use atomic
+// read-modify-writes.
+static const unsigned int stats_shared_slot = max_vcpus;
+
+extern bool stats_enabled;
+extern vcpu_counters stats_vcpus[max_vcpus + 1];
+// The vCPU the calling thread last ran an execution callback for. Translations and memory map
+// lookups don't get the vCPU index from QEMU so they're counted in this vCPU's counters.
+extern thread_local unsigned int stats_thread_vcpu;
+
+// Start counting. Must be called before any callbacks are registered.
+void stats_init();
+
+// A timestamp in ticks of the TSC, or nanoseconds on hosts without one. Ticks are converted to time
+// in the report.
+static inline uint64_t stats_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+static inline void stats_count_callback(unsigned int vcpu_idx, stats_callback callback) {
+    if (stats_enabled) {
+        std::atomic<uint64_t> &count = stats_vcpus[vcpu_idx].callbacks[callback];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        stats_thread_vcpu = vcpu_idx;
+    }
+}
+
+// Count a translated block with `num_insns` instructions of which `num_classified` were passed to
+// the backend, taking `backend_ticks` in total
+void stats_count_translation(size_t num_insns, size_t num_classified, uint64_t backend_ticks);
+
+// Count a lookup in the memory map which took `ticks` and whether it re-parsed /proc/self/maps
+void stats_count_maps_lookup(uint64_t ticks, bool reparsed);
+
+void stats_count_bytes_written(size_t bytes);
+
+// Print the report to stdout and, if `json_path` is not NULL, also write it there as JSON
+void stats_report(const char *json_path);
+
+#endif
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "elf_file.h"
+#include "symbolizer.h"
+
+using namespace std;
+
+typedef struct image_symbols {
+    mutex lock;
+    bool indexed;
+    vector<elf_symbol> symbols;
+    unordered_map<uint64_t, string> resolved;
+} image_symbols;
+
+static mutex images_lock;
+static unordered_map<string, unique_ptr<image_symbols>> images;
+
+static const string no_symbol;
+
+static image_symbols &get_image(const string &path) {
+    lock_guard<mutex> guard(images_lock);
+    unique_ptr<image_symbols> &image = images[path];
+    if (!image) {
+        image = make_unique<image_symbols>();
+        image->indexed = false;
+    }
+    return *image;
+}
+
+// Find the symbol containing `offset` with a binary search. Symbols without a size extend to the
+// next symbol.
+static string lookup(const vector<elf_symbol> &symbols, uint64_t offset) {
+    auto next = upper_bound(symbols.begin(), symbols.end(), offset,
+                            [](uint64_t offset, const elf_symbol &sym) { return offset < sym.offset; });
+    if (next == symbols.begin()) {
+        return "";
+    }
+    const elf_symbol &sym = *(next - 1);
+    uint64_t delta = offset - sym.offset;
+    if (sym.size && (delta >= sym.size)) {
+        return "";
+    }
+    if (!delta) {
+        return sym.name;
+    }
+    char suffix[sizeof("+0x") + 16];
+    snprintf(suffix, sizeof(suffix), "+0x%lx", delta);
+    return sym.name + suffix;
+}
+
+// Must be called with the image's lock held
+static const string &resolve(image_symbols &image, const string &path, uint64_t offset) {
+    auto it = image.resolved.find(offset);
+    if (it != image.resolved.end()) {
+        return it->second;
+    }
+    if (!image.indexed) {
+        // Pseudo-files like [vdso] and [heap] don't have paths
+        if (path[0] == '/') {
+            image.symbols = elf_function_symbols(path);
+        }
+        image.indexed = true;
+    }
+    // References to unordered_map values stay valid as the map grows
+    return image.resolved.emplace(offset, lookup(image.symbols, offset)).first->second;
+}
+
+const string &symbolize(const string &path, uint64_t offset) {
+    if (path.empty()) {
+        return no_symbol;
+    }
+    image_symbols &image = get_image(path);
+    lock_guard<mutex> guard(image.lock);
+    return resolve(image, path, offset);
+}
+
+void symbolizer_prepare(const vector<pair<string, uint64_t>> &offsets) {
+    map<string, vector<uint64_t>> by_image;
+    for (const auto &[path, offset] : offsets) {
+        if (!path.empty()) {
+            by_image[path].push_back(offset);
+        }
+    }
+    vector<pair<const string *, const vector<uint64_t> *>> work;
+    for (const auto &[path, image_offsets] : by_image) {
+        work.push_back({&path, &image_offsets});
+    }
+
+    // Each worker takes whole images so reading an image's symbols is never duplicated
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < work.size(); i = next++) {
+            const string &path = *work[i].first;
+            image_symbols &image = get_image(path);
+            lock_guard<mutex> guard(image.lock);
+            for (uint64_t offset : *work[i].second) {
+                resolve(image, path, offset);
+            }
+        }
+    };
+    size_t num_threads = min<size_t>(work.size(), max(thread::hardware_concurrency(), 1U));
+    vector<thread> threads;
+    for (size_t i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (thread &t : threads) {
+        t.join();
+    }
+}
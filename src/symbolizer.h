@@ -0,0 +1,22 @@
+#ifndef SYMBOLIZER_H
+#define SYMBOLIZER_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Resolves file offsets in ELF images to the functions containing them. Each image's symbol table
+// is read once and kept as a sorted index, and the result for each offset is memoized so this is
+// only called off the hot path (i.e. by the writer thread or at exit).
+
+// Get the function containing `offset` in the ELF file at `path` as `function` or
+// `function+0x<off>`. Returns an empty string if the offset isn't covered by a function symbol.
+// This may be called from multiple threads.
+const std::string &symbolize(const std::string &path, uint64_t offset);
+
+// Index the images and resolve the (path, offset) pairs ahead of time, in parallel across images,
+// so later calls to `symbolize` for them only hit the memo
+void symbolizer_prepare(const std::vector<std::pair<std::string, uint64_t>> &offsets);
+
+#endif
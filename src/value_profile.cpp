@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <utility>
+
+#include "value_profile.h"
+
+using namespace std;
+
+static const size_t initial_slots = 256;
+
+static size_t config_k = 1;
+
+void value_profile_init(size_t targets_per_callsite) { config_k = targets_per_callsite; }
+
+value_profile::value_profile()
+    : k(config_k),
+      callsites(initial_slots, UINT64_MAX),
+      num_callsites(0),
+      counters(initial_slots * config_k) {}
+
+size_t value_profile::insert(uint64_t callsite_vaddr) {
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if (2 * (num_callsites + 1) > callsites.size()) {
+        vector<uint64_t> old_callsites(2 * callsites.size(), UINT64_MAX);
+        vector<counter> old_counters(old_callsites.size() * k);
+        old_callsites.swap(callsites);
+        old_counters.swap(counters);
+        for (size_t i = 0; i < old_callsites.size(); i++) {
+            if (old_callsites[i] != UINT64_MAX) {
+                size_t j = probe(old_callsites[i]);
+                callsites[j] = old_callsites[i];
+                copy_n(&old_counters[i * k], k, &counters[j * k]);
+            }
+        }
+    }
+    num_callsites++;
+    size_t i = probe(callsite_vaddr);
+    callsites[i] = callsite_vaddr;
+    return i;
+}
+
+size_t value_profile::replace(counter *targets, size_t i, uint64_t callsite_vaddr,
+                              uint64_t dst_vaddr, ibresolver_branch_kind kind) {
+    // Evict the destination with the lowest count. The new one inherits that count since it may
+    // have been taken that many times while it didn't have a counter.
+    uint64_t count = 0;
+    if (i == k) {
+        i = k - 1;
+        count = targets[i].e.count;
+    }
+    // Resolve the offsets when the destination gets a counter rather than on every execution. The
+    // callsite was already resolved if it has other destinations.
+    optional<image_offset> callsite;
+    if (targets[0].e.count != 0) {
+        callsite = targets[0].e.resolved ? optional<image_offset>(targets[0].e.callsite) : nullopt;
+    } else {
+        callsite = guest_vaddr_to_offset(callsite_vaddr);
+        if (!callsite.has_value()) {
+            cout << "ERROR: Unable to find callsite address in /proc/self/maps" << endl;
+        }
+    }
+    optional<image_offset> dst = guest_vaddr_to_offset(dst_vaddr);
+    if (!dst.has_value()) {
+        cout << "ERROR: Unable to find destination address in /proc/self/maps" << endl;
+    }
+    targets[i].error = count;
+    edge &e = targets[i].e;
+    e.callsite_vaddr = callsite_vaddr;
+    e.dst_vaddr = dst_vaddr;
+    e.count = count;
+    e.resolved = callsite.has_value() && dst.has_value();
+    if (e.resolved) {
+        e.callsite = callsite.value();
+        e.dst = dst.value();
+    }
+    e.kind = kind;
+    return i;
+}
+
+vector<profile_edge> value_profile_edges(const vector<const value_profile *> &profiles) {
+    // The sum over all vCPUs of the callsite's executions and of the lowest counts of the vCPUs
+    // whose counters are all used
+    typedef struct callsite_totals {
+        uint64_t executions;
+        uint64_t lowest_counts;
+    } callsite_totals;
+    // A merged edge. `lowest_counts` is the part of the callsite's total from vCPUs that kept the
+    // destination, which doesn't need to be added.
+    typedef struct merged_edge {
+        profile_edge p;
+        uint64_t lowest_counts;
+    } merged_edge;
+    map<uint64_t, callsite_totals> totals;
+    map<pair<uint64_t, uint64_t>, merged_edge> merged;
+    for (const value_profile *profile : profiles) {
+        const vector<value_profile::counter> &counters = profile->targets();
+        size_t k = profile->targets_per_callsite();
+        for (size_t start = 0; start < counters.size(); start += k) {
+            const value_profile::counter *targets = &counters[start];
+            if (targets[0].e.count == 0) {
+                continue;
+            }
+            // The counts of a callsite's counters always add up to its number of executions
+            uint64_t executions = 0;
+            for (size_t i = 0; (i < k) && (targets[i].e.count != 0); i++) {
+                executions += targets[i].e.count;
+            }
+            uint64_t lowest_count = targets[k - 1].e.count;
+            callsite_totals &callsite = totals[targets[0].e.callsite_vaddr];
+            callsite.executions += executions;
+            callsite.lowest_counts += lowest_count;
+            for (size_t i = 0; (i < k) && (targets[i].e.count != 0); i++) {
+                const edge &e = targets[i].e;
+                // Keep the offsets resolved first
+                auto [it, inserted] = merged.insert(
+                    {{e.callsite_vaddr, e.dst_vaddr},
+                     {.p = {.e = e, .counts = {.error = 0, .callsite_executions = 0}},
+                      .lowest_counts = 0}});
+                if (!inserted) {
+                    it->second.p.e.count += e.count;
+                }
+                it->second.p.counts.error += targets[i].error;
+                it->second.lowest_counts += lowest_count;
+            }
+        }
+    }
+    vector<profile_edge> edges;
+    edges.reserve(merged.size());
+    for (auto &[key, m] : merged) {
+        const callsite_totals &callsite = totals[key.first];
+        uint64_t missing = callsite.lowest_counts - m.lowest_counts;
+        m.p.e.count += missing;
+        m.p.counts.error += missing;
+        m.p.counts.callsite_executions = callsite.executions;
+        edges.push_back(m.p);
+    }
+    sort(edges.begin(), edges.end(), [](const profile_edge &a, const profile_edge &b) {
+        if (a.e.callsite_vaddr != b.e.callsite_vaddr) {
+            if (a.counts.callsite_executions != b.counts.callsite_executions) {
+                return a.counts.callsite_executions > b.counts.callsite_executions;
+            }
+            return a.e.callsite_vaddr < b.e.callsite_vaddr;
+        }
+        if (a.e.count != b.e.count) {
+            return a.e.count > b.e.count;
+        }
+        return a.e.dst_vaddr < b.e.dst_vaddr;
+    });
+    // Each vCPU kept K destinations per callsite so merging may give a callsite more than K
+    vector<profile_edge> top;
+    size_t kept = 0;
+    for (size_t i = 0; i < edges.size(); i++) {
+        if ((i == 0) || (edges[i].e.callsite_vaddr != edges[i - 1].e.callsite_vaddr)) {
+            kept = 0;
+        }
+        if (kept++ < config_k) {
+            top.push_back(edges[i]);
+        }
+    }
+    return top;
+}
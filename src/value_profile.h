@@ -0,0 +1,110 @@
+#ifndef VALUE_PROFILE_H
+#define VALUE_PROFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "edge_table.h"
+#include "format.h"
+
+// The largest number of destinations that can be kept per callsite
+static const size_t max_profile_targets = 64;
+
+// Set the number of destinations kept per callsite by all profiles. Must be called before any
+// profile is created.
+void value_profile_init(size_t targets_per_callsite);
+
+// Counts the most frequent destinations of each callsite executed by one vCPU in bounded memory
+// with the space-saving algorithm. Each callsite has K counters. A destination without a counter
+// takes over the one with the lowest count and adds one to it, so counts may overestimate how often
+// a destination was taken by at most N/K where N is the number of times the callsite was executed.
+// Destinations taken more than N/K times always have a counter. Each counter also keeps the count it
+// took over as its error, so the destination was taken between `count - error` and `count` times.
+class value_profile {
+   public:
+    value_profile();
+
+    // Count one execution of the edge from `callsite_vaddr` (a branch of `kind`) to `dst_vaddr`
+    void add(uint64_t callsite_vaddr, uint64_t dst_vaddr, ibresolver_branch_kind kind) {
+        counter *targets = &counters[find_or_insert(callsite_vaddr) * k];
+        // Counters are sorted by decreasing count so hot destinations are found first, unused
+        // counters (with a zero count) are at the end and the last counter has the lowest count
+        size_t i = 0;
+        while ((i < k) && (targets[i].e.count != 0) && (targets[i].e.dst_vaddr != dst_vaddr)) {
+            i++;
+        }
+        if ((i == k) || (targets[i].e.count == 0)) {
+            i = replace(targets, i, callsite_vaddr, dst_vaddr, kind);
+        }
+        targets[i].e.count++;
+        // Restore the order. The count only went up by one so this rarely moves the counter.
+        while ((i > 0) && (targets[i - 1].e.count < targets[i].e.count)) {
+            std::swap(targets[i - 1], targets[i]);
+            i--;
+        }
+    }
+
+    // A destination counted for a callsite
+    typedef struct counter {
+        edge e;
+        // The count the destination inherited when it took over the counter
+        uint64_t error;
+    } counter;
+
+    // Get the `k` counters of each callsite one after another. The counts of unused counters are
+    // zero.
+    const std::vector<counter> &targets() const { return counters; }
+    size_t targets_per_callsite() const { return k; }
+
+   private:
+    // Get the index of the callsite's slot in `callsites` or the empty slot it would be inserted in
+    size_t probe(uint64_t callsite_vaddr) const {
+        size_t mask = callsites.size() - 1;
+        // Instructions are at least 2-byte aligned on arm
+        size_t i = (((callsite_vaddr >> 1) * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+        // Linear probing
+        while ((callsites[i] != callsite_vaddr) && (callsites[i] != UINT64_MAX)) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    size_t find_or_insert(uint64_t callsite_vaddr) {
+        size_t i = probe(callsite_vaddr);
+        if (callsites[i] == callsite_vaddr) {
+            return i;
+        }
+        return insert(callsite_vaddr);
+    }
+
+    size_t insert(uint64_t callsite_vaddr);
+    // Give the destination a counter, either the unused counter `i` or the one with the lowest
+    // count if all are used. Returns the index of the counter.
+    size_t replace(counter *targets, size_t i, uint64_t callsite_vaddr, uint64_t dst_vaddr,
+                   ibresolver_branch_kind kind);
+
+    // Copied from the config so the fast path doesn't need to load it
+    size_t k;
+    // Callsite vaddrs, all-ones for unused slots. The number of slots is always a power of two.
+    std::vector<uint64_t> callsites;
+    size_t num_callsites;
+    // The `k` counters of the callsite in slot i start at index `i * k`
+    std::vector<counter> counters;
+};
+
+// An edge of a merged profile with the error bound of its count
+typedef struct profile_edge {
+    edge e;
+    profile_counts counts;
+} profile_edge;
+
+// Merge the profiles of all vCPUs, keeping the K destinations with the highest total counts for
+// each callsite. Edges are sorted by how often their callsite was executed, then by decreasing
+// count, so each callsite's destinations are contiguous. A vCPU whose counters for a callsite are
+// all used may have taken a destination it didn't keep as many times as its lowest count, so that
+// count is added to both the count and error of the merged edge. The merged counts keep the same
+// bound as a single profile.
+std::vector<profile_edge> value_profile_edges(const std::vector<const value_profile *> &profiles);
+
+#endif
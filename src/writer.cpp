@@ -0,0 +1,369 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "plugin.h"
+#include "stats.h"
+#include "writer.h"
+
+using namespace std;
+
+// Single-producer single-consumer ring of edges taken by one vCPU. The vCPU thread pushes and the
+// writer thread pops so neither side takes a lock.
+class edge_ring {
+   public:
+    edge_ring() : head(0), tail(0), dropped(0), records(capacity) {}
+
+    // Called by the vCPU thread. Returns false if the ring is full.
+    bool try_push(const edge &e) {
+        size_t h = head.load(memory_order_relaxed);
+        size_t t = tail.load(memory_order_acquire);
+        if (h - t == capacity) {
+            return false;
+        }
+        records[h & (capacity - 1)] = e;
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Called by the vCPU thread after pushing. Returns true if the ring just became half full.
+    bool half_full() const {
+        size_t h = head.load(memory_order_relaxed);
+        return h - tail.load(memory_order_relaxed) == capacity / 2;
+    }
+
+    // Called by the writer thread to process all queued edges
+    template <typename F>
+    void pop_all(F f) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t h = head.load(memory_order_acquire);
+        for (size_t i = t; i != h; i++) {
+            f(records[i & (capacity - 1)]);
+        }
+        tail.store(h, memory_order_release);
+    }
+
+    // Discard all queued edges
+    void clear() { tail.store(head.load(memory_order_relaxed), memory_order_relaxed); }
+
+    static const size_t capacity = 16 * 1024;
+
+    // Padded so the producer and consumer don't write to the same cache line
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+    // Only written by the vCPU thread
+    alignas(64) size_t dropped;
+    vector<edge> records;
+};
+
+// Size at which the writer thread writes formatted output while draining the rings
+static const size_t chunk_size = 1024 * 1024;
+
+static int out_fd = -1;
+// Guards writes to `out_fd`
+static mutex output_lock;
+// Set if the output is a socket so each write is sent as a frame
+static bool framed = false;
+// NULL if the output isn't compressed. Only used with `output_lock` held.
+static unique_ptr<frame_compressor> compressor;
+// Set after a write fails so the error is only reported once (e.g. when the consumer disconnects)
+static bool output_failed = false;
+
+static atomic<edge_ring *> rings[max_vcpus];
+static format_edge_fn format;
+static full_policy policy;
+static chrono::milliseconds flush_interval;
+
+static thread *writer_thread = NULL;
+// Guards `stopping` and is used with `wake` to wake the writer thread early
+static mutex wake_lock;
+static condition_variable wake;
+static bool stopping = false;
+// Set in a forked child since only the thread calling fork exists in the child
+static atomic<bool> restart_needed(false);
+// Set in a forked child if the output was a socket. See `after_fork_child`.
+static bool socket_dropped = false;
+
+static bool write_bytes(string_view data) {
+    while (!data.empty()) {
+        ssize_t written = write(out_fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        stats_count_bytes_written(written);
+        data.remove_prefix(written);
+    }
+    return true;
+}
+
+// Send the size and payload of a frame with as few syscalls as possible, continuing after partial
+// sends until the whole frame is sent
+static bool send_frame(string_view data) {
+    uint32_t size = data.size();
+    uint8_t frame_header[4] = {(uint8_t)size, (uint8_t)(size >> 8), (uint8_t)(size >> 16),
+                               (uint8_t)(size >> 24)};
+    struct iovec iov[2] = {
+        {.iov_base = frame_header, .iov_len = sizeof(frame_header)},
+        {.iov_base = (void *)data.data(), .iov_len = data.size()},
+    };
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (msg.msg_iovlen) {
+        // Sockets don't raise SIGPIPE so a consumer going away doesn't kill the guest
+        ssize_t sent = sendmsg(out_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        stats_count_bytes_written(sent);
+        while (msg.msg_iovlen && ((size_t)sent >= msg.msg_iov->iov_len)) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+static void write_all(string_view data) {
+    if (output_failed || ((framed || compressor) && data.empty())) {
+        return;
+    }
+    // Compress each write into its own frame so a truncated file can be read up to the last one
+    string compressed;
+    if (compressor) {
+        if (!compressor->compress(data, compressed)) {
+            cout << "ERROR: Unable to compress the output" << endl;
+            output_failed = true;
+            return;
+        }
+        data = compressed;
+    }
+    if (!(framed ? send_frame(data) : write_bytes(data))) {
+        cout << "ERROR: Unable to write to the output " << (framed ? "socket" : "file") << ": "
+             << strerror(errno) << endl;
+        output_failed = true;
+    }
+}
+
+// Format and write all queued edges
+static void drain() {
+    string chunk;
+    chunk.reserve(chunk_size);
+    for (atomic<edge_ring *> &slot : rings) {
+        edge_ring *ring = slot.load(memory_order_acquire);
+        if (!ring) {
+            continue;
+        }
+        ring->pop_all([&](const edge &e) {
+            format(chunk, e);
+            if (chunk.size() >= chunk_size) {
+                lock_guard<mutex> guard(output_lock);
+                write_all(chunk);
+                chunk.clear();
+            }
+        });
+    }
+    lock_guard<mutex> guard(output_lock);
+    write_all(chunk);
+}
+
+static void writer_loop() {
+    unique_lock<mutex> lock(wake_lock);
+    while (!stopping) {
+        wake.wait_for(lock, flush_interval);
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+}
+
+// Take the writer's locks so the child doesn't inherit them in a locked state
+static void before_fork() {
+    wake_lock.lock();
+    output_lock.lock();
+}
+
+static void after_fork_parent() {
+    output_lock.unlock();
+    wake_lock.unlock();
+}
+
+static void after_fork_child() {
+    output_lock.unlock();
+    wake_lock.unlock();
+    // Edges queued before the fork are written by the parent
+    for (atomic<edge_ring *> &slot : rings) {
+        edge_ring *ring = slot.load(memory_order_relaxed);
+        if (ring) {
+            ring->clear();
+        }
+    }
+    // The writer thread doesn't exist in the child and starting threads here is not safe so the
+    // next push starts a new one. The old thread object can't be joined or destroyed so leak it.
+    writer_thread = NULL;
+    restart_needed.store(true, memory_order_release);
+    // The consumer only expects one stream so the child's frames would be interleaved with the
+    // parent's. Its edges are still drained from the rings but not sent.
+    if (framed) {
+        close(out_fd);
+        out_fd = -1;
+        output_failed = true;
+        socket_dropped = true;
+    }
+}
+
+static bool connect_socket(const char *path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    out_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (out_fd < 0) {
+        return false;
+    }
+    if (connect(out_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(out_fd);
+        out_fd = -1;
+        return false;
+    }
+    framed = true;
+    return true;
+}
+
+bool writer_open(const char *path, compression c) {
+    if (c != NO_COMPRESSION) {
+        compressor = make_unique<frame_compressor>(c);
+    }
+    if (!strncmp(path, socket_prefix, strlen(socket_prefix))) {
+        return connect_socket(path + strlen(socket_prefix));
+    }
+    out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return out_fd >= 0;
+}
+
+void writer_start(format_edge_fn format_edge, size_t flush_ms, full_policy full) {
+    format = format_edge;
+    flush_interval = chrono::milliseconds(flush_ms);
+    policy = full;
+    writer_thread = new thread(writer_loop);
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+}
+
+void writer_add_vcpu(unsigned int vcpu_idx) {
+    // Rings are kept when a vCPU exits so a vCPU reusing the index may already have one
+    if (!rings[vcpu_idx].load(memory_order_relaxed)) {
+        rings[vcpu_idx].store(new edge_ring(), memory_order_release);
+    }
+}
+
+void writer_push(unsigned int vcpu_idx, const edge &e) {
+    if (restart_needed.load(memory_order_relaxed) && restart_needed.exchange(false)) {
+        if (socket_dropped) {
+            cout << "WARNING: Edges of forked child processes are not sent to the output socket"
+                 << endl;
+        }
+        writer_thread = new thread(writer_loop);
+    }
+    edge_ring *ring = rings[vcpu_idx].load(memory_order_relaxed);
+    while (!ring->try_push(e)) {
+        if (policy == DROP) {
+            ring->dropped++;
+            return;
+        }
+        // Backpressure: wait for the writer thread to drain the ring
+        wake.notify_one();
+        this_thread::yield();
+    }
+    // Wake the writer early rather than waiting for the flush interval so the ring doesn't fill up
+    if (ring->half_full()) {
+        wake.notify_one();
+    }
+}
+
+void writer_write(string_view data) {
+    lock_guard<mutex> guard(output_lock);
+    write_all(data);
+}
+
+bool writer_overwrite(size_t offset, string_view data) {
+    lock_guard<mutex> guard(output_lock);
+    // Frames that were already sent or compressed can't be changed
+    if (framed || compressor) {
+        return false;
+    }
+    while (!data.empty()) {
+        ssize_t written = pwrite(out_fd, data.data(), data.size(), offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // e.g. the output is a pipe
+            return false;
+        }
+        data.remove_prefix(written);
+        offset += written;
+    }
+    return true;
+}
+
+void writer_write_edges(const vector<edge> &edges) {
+    string chunk;
+    for (const edge &e : edges) {
+        format(chunk, e);
+        if (chunk.size() >= chunk_size) {
+            writer_write(chunk);
+            chunk.clear();
+        }
+    }
+    writer_write(chunk);
+}
+
+size_t writer_stop() {
+    if (writer_thread) {
+        {
+            lock_guard<mutex> guard(wake_lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer_thread->join();
+        delete writer_thread;
+        writer_thread = NULL;
+    }
+    drain();
+    size_t dropped = 0;
+    for (atomic<edge_ring *> &slot : rings) {
+        edge_ring *ring = slot.load(memory_order_acquire);
+        if (ring) {
+            dropped += ring->dropped;
+        }
+    }
+    close(out_fd);
+    out_fd = -1;
+    return dropped;
+}
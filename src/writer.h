@@ -0,0 +1,58 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compress.h"
+#include "edge_table.h"
+
+// Appends the formatted `edge` to the output chunk
+typedef void (*format_edge_fn)(std::string &chunk, const edge &e);
+
+typedef enum full_policy {
+    // Wait for the writer thread to make room in the ring
+    BLOCK,
+    // Discard the edge and count it as dropped
+    DROP,
+} full_policy;
+
+// Paths starting with this are UNIX domain sockets to stream the output to
+static const char socket_prefix[] = "unix:";
+
+// Open the output file or connect to the socket if `path` starts with `socket_prefix`. Returns false
+// if it can't be opened. Output sent to a socket is split into frames which each start with the
+// frame's size as a little-endian u32, followed by that many bytes of output. Frames are sent by the
+// background thread (or at exit) so a slow consumer only stalls the vCPUs through `full_policy`.
+// Concatenating the frames gives the same bytes as writing to a file. With compression each write
+// is compressed separately by the writer thread (see compress.h) before it's written or framed.
+bool writer_open(const char *path, compression c = NO_COMPRESSION);
+
+// Start the background thread which formats edges with `format_edge` and writes them to the output
+// file at least every `flush_ms` milliseconds
+void writer_start(format_edge_fn format_edge, size_t flush_ms, full_policy policy);
+
+// Allocate the ring buffer for a vCPU. This must be called before `writer_push` is used by the vCPU.
+void writer_add_vcpu(unsigned int vcpu_idx);
+
+// Queue an edge taken by a vCPU to be written by the background thread. This does not take any
+// locks so it can be called from the vCPU's execution callbacks.
+void writer_push(unsigned int vcpu_idx, const edge &e);
+
+// Synchronously write raw bytes (e.g. a header) to the output file
+void writer_write(std::string_view data);
+
+// Overwrite bytes already written at `offset` in the output file (e.g. to update counts in the
+// header). Returns false if the output can't be written at an offset.
+bool writer_overwrite(size_t offset, std::string_view data);
+
+// Synchronously format and write edges to the output file
+void writer_write_edges(const std::vector<edge> &edges);
+
+// Write all queued edges, stop the background thread and close the output file. Returns the number
+// of edges dropped because a ring buffer was full.
+size_t writer_stop();
+
+#endif
@@ -1,4 +1,5 @@
 import csv
+import functools
 from elftools.elf.elffile import ELFFile
 
 def open_elf(filename):
@@ -9,16 +10,24 @@ def open_csv(filename):
     f = open(filename + ".csv", newline='')
     return csv.reader(f)
 
-def sym_addr(filename, sym_name):
+@functools.lru_cache(maxsize=None)
+def symbol_table(filename):
     """
-    Gets the address of the first symbol matching `sym_name` in `filename + ".elf"`
+    Maps each symbol name in `filename + ".elf"` to the address of the first symbol with that name.
+    The ELF is only read once per file.
     """
     elf = open_elf(filename)
     symtab = elf.get_section_by_name('.symtab')
-    syms = symtab.get_symbol_by_name(sym_name)
-    if len(syms) == 0:
-        return None
-    return syms[0]['st_value']
+    addrs = {}
+    for sym in symtab.iter_symbols():
+        addrs.setdefault(sym.name, sym['st_value'])
+    return addrs
+
+def sym_addr(filename, sym_name):
+    """
+    Gets the address of the first symbol matching `sym_name` in `filename + ".elf"`
+    """
+    return symbol_table(filename).get(sym_name)
 
 def check_jump(filename, origin, dst):
     """
@@ -0,0 +1,285 @@
+"""
+Runs the plugin on the traces in `replay/` with the fake QEMU host built by `make`
+(tools/replay_host.cpp) so these tests don't need a patched QEMU
+"""
+import csv
+import gzip
+import json
+import zlib
+import os
+import subprocess
+
+import pytest
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(TESTS_DIR)
+REPLAY_HOST = os.path.join(ROOT_DIR, "replay_host")
+PLUGIN = os.path.join(ROOT_DIR, "libibresolver.so")
+BIN2CSV = os.path.join(ROOT_DIR, "bin2csv")
+CONSUMER = os.path.join(ROOT_DIR, "edge_consumer")
+
+pytestmark = pytest.mark.skipif(not os.path.exists(REPLAY_HOST) or not os.path.exists(PLUGIN),
+                                reason="run `make` first to build the plugin and replay host")
+
+def replay(trace, output, *args):
+    """
+    Replays `replay/{trace}.trace` with the plugin writing to `output` and returns the output rows
+    after the header, or None if the output isn't a plain csv file
+    """
+    plugin_args = ",".join([PLUGIN, "output=" + str(output)] + list(args))
+    subprocess.run([REPLAY_HOST, os.path.join(TESTS_DIR, "replay", trace + ".trace"), plugin_args],
+                   check=True)
+    if "format=bin" in args or "compress=gzip" in args or str(output).startswith("unix:"):
+        return None
+    with open(output, newline='') as f:
+        return list(csv.reader(f))[1:]
+
+def edge_counts(rows):
+    """
+    Maps each (callsite offset, dest offset) pair in aggregate mode output to its count
+    """
+    return {(int(row[0], 16), int(row[1], 16)): int(row[6]) for row in rows}
+
+def test_replay_fn_ptr(tmp_path):
+    """
+    The indirect call in fn_ptr.c to `add` and `sub` in stream mode
+    """
+    rows = replay("fn_ptr", tmp_path / "out.csv")
+    edges = [(int(row[0], 16), int(row[1], 16)) for row in rows]
+    assert edges == [(0x117f, 0x1139), (0x117f, 0x114d)]
+    assert all(row[4].endswith("tests/x86-64/fn_ptr.elf") for row in rows)
+
+def test_replay_aggregate_counts(tmp_path):
+    """
+    Counts from several vCPUs are merged and survive flushing the translated blocks
+    """
+    counts = edge_counts(replay("hot_loop", tmp_path / "out.csv", "mode=aggregate"))
+    assert counts == {(0x117f, 0x1139): 1500, (0x117f, 0x114d): 1000}
+
+def test_replay_self_modifying(tmp_path):
+    """
+    Executions before a block's code is modified use the old translation
+    """
+    counts = edge_counts(replay("self_modifying", tmp_path / "out.csv", "mode=aggregate"))
+    assert counts == {(0x117f, 0x1139): 1}
+
+def test_replay_value_profile(tmp_path):
+    """
+    A profile with room for every destination has the exact counts. With fewer counters the hottest
+    destination is kept and its count may be overestimated by at most its error.
+    """
+    exact_rows = replay("hot_loop", tmp_path / "exact.csv", "profile=topk:2")
+    assert edge_counts(exact_rows) == {(0x117f, 0x1139): 1500, (0x117f, 0x114d): 1000}
+    # Each row also has the error of its count and its callsite's executions
+    assert [row[7:] for row in exact_rows] == [["0", "2500"], ["0", "2500"]]
+    top_rows = replay("hot_loop", tmp_path / "top.csv", "profile=topk:1")
+    top = edge_counts(top_rows)
+    assert list(top) == [(0x117f, 0x1139)]
+    count, error, executions = (int(column) for column in top_rows[0][6:])
+    assert count - error <= 1500 <= count <= executions == 2500
+    # The binary format keeps the profile columns
+    replay("hot_loop", tmp_path / "top.bin", "profile=topk:1", "format=bin")
+    subprocess.run([BIN2CSV, tmp_path / "top.bin", tmp_path / "converted.csv"], check=True)
+    with open(tmp_path / "top.csv") as expected, open(tmp_path / "converted.csv") as converted:
+        assert expected.read() == converted.read()
+
+def test_replay_arm_thumb_mixed(tmp_path):
+    """
+    The simple backend finds calls and returns in both ARM and THUMB code
+    """
+    counts = edge_counts(replay("arm_thumb_mixed", tmp_path / "out.csv", "mode=aggregate"))
+    for callsite in [0x6a2, 0x73c]:
+        assert counts[(callsite, 0x630)] == 1
+        assert counts[(callsite, 0x648)] == 1
+    # The `pop {..., pc}` returns from the callees
+    assert counts[(0x640, 0x6a4)] == 1
+    assert counts[(0x664, 0x740)] == 1
+
+def test_replay_insn_sets(tmp_path):
+    """
+    Classifications cached for ARM code aren't reused for the same bytes in THUMB code
+    """
+    counts = edge_counts(replay("insn_sets", tmp_path / "out.csv", "mode=aggregate"))
+    assert counts == {(0x640, 0x712): 1, (0x714, 0x630): 1}
+
+def test_replay_bin_format(tmp_path):
+    """
+    The binary format converts back to the same csv
+    """
+    replay("hot_loop", tmp_path / "out.csv", "mode=aggregate")
+    replay("hot_loop", tmp_path / "out.bin", "mode=aggregate", "format=bin")
+    subprocess.run([BIN2CSV, tmp_path / "out.bin", tmp_path / "converted.csv"], check=True)
+    with open(tmp_path / "out.csv") as expected, open(tmp_path / "converted.csv") as converted:
+        assert expected.read() == converted.read()
+
+def test_replay_socket(tmp_path):
+    """
+    Streaming to a socket sends the binary output in frames which the reference consumer
+    reassembles into a file bin2csv can read
+    """
+    expected = replay("hot_loop", tmp_path / "expected.csv")
+    socket_path = tmp_path / "edges.sock"
+    consumer = subprocess.Popen([CONSUMER, socket_path, tmp_path / "received.bin"],
+                                stdout=subprocess.PIPE, text=True)
+    assert consumer.stdout.readline().startswith("Listening")
+    replay("hot_loop", "unix:" + str(socket_path), "flush_ms=1")
+    assert consumer.wait(timeout=10) == 0
+    subprocess.run([BIN2CSV, tmp_path / "received.bin", tmp_path / "received.csv"], check=True)
+    with open(tmp_path / "received.csv", newline='') as f:
+        received = list(csv.reader(f))[1:]
+    # Edges from different vCPUs are interleaved depending on when the writer thread runs
+    assert sorted(received) == sorted(expected)
+
+def test_replay_compress(tmp_path):
+    """
+    Compressed output decompresses to the same csv, and bin2csv reads compressed binary output even
+    if the last frame was cut off
+    """
+    expected = replay("hot_loop", tmp_path / "expected.csv", "mode=aggregate")
+    replay("hot_loop", tmp_path / "out.csv.gz", "mode=aggregate", "compress=gzip", "format=csv")
+    with gzip.open(tmp_path / "out.csv.gz", "rt", newline='') as f:
+        assert list(csv.reader(f))[1:] == expected
+    replay("hot_loop", tmp_path / "out.bin.gz", "mode=aggregate", "compress=gzip", "format=bin")
+    subprocess.run([BIN2CSV, tmp_path / "out.bin.gz", tmp_path / "converted.csv"], check=True)
+    with open(tmp_path / "converted.csv", newline='') as f:
+        assert list(csv.reader(f))[1:] == expected
+    # The header is its own frame so cutting off the edges still leaves a readable file
+    with open(tmp_path / "out.bin.gz", "rb") as f:
+        data = f.read()
+    header_frame = zlib.decompressobj(wbits=31)
+    header_frame.decompress(data)
+    with open(tmp_path / "truncated.bin.gz", "wb") as f:
+        f.write(data[:len(data) - len(header_frame.unused_data) + 10])
+    subprocess.run([BIN2CSV, tmp_path / "truncated.bin.gz", tmp_path / "truncated.csv"], check=True)
+    with open(tmp_path / "truncated.csv", newline='') as f:
+        assert list(csv.reader(f))[1:] == []
+
+def test_replay_symbolize(tmp_path):
+    """
+    Callsites and destinations are resolved to the functions containing them, both by the plugin
+    and by bin2csv
+    """
+    rows = replay("fn_ptr", tmp_path / "out.csv", "mode=aggregate", "symbolize=on")
+    symbols = {(int(row[0], 16), int(row[1], 16)): (row[6], row[7]) for row in rows}
+    assert symbols == {(0x117f, 0x1139): ("call_with_args+0x20", "add"),
+                       (0x117f, 0x114d): ("call_with_args+0x20", "sub")}
+    replay("fn_ptr", tmp_path / "out.bin", "mode=aggregate", "format=bin")
+    subprocess.run([BIN2CSV, "--symbolize", tmp_path / "out.bin", tmp_path / "converted.csv"],
+                   check=True)
+    with open(tmp_path / "out.csv") as expected, open(tmp_path / "converted.csv") as converted:
+        assert expected.read() == converted.read()
+
+def test_replay_known_edges(tmp_path):
+    """
+    Edges in the database from a previous run aren't written again in either mode
+    """
+    known = "known=" + str(tmp_path / "known.db")
+    assert len(replay("fn_ptr", tmp_path / "first.csv", known)) == 2
+    assert replay("fn_ptr", tmp_path / "second.csv", known) == []
+    assert replay("hot_loop", tmp_path / "third.csv", "mode=aggregate", known) == []
+
+def test_replay_image_table(tmp_path):
+    """
+    With `image_table=on` each image is written once and rows refer to it by ID. bin2csv produces
+    the same table from the binary format.
+    """
+    replay("fn_ptr", tmp_path / "out.csv", "image_table=on")
+    with open(tmp_path / "out.csv") as f:
+        lines = f.read().splitlines()
+    images = [line.split(",") for line in lines if line.startswith("#image,")]
+    assert len(images) == 1
+    assert images[0][1] == "0"
+    assert images[0][4].endswith("tests/x86-64/fn_ptr.elf")
+    rows = [line.split(",") for line in lines[1:] if not line.startswith("#")]
+    assert [row[4:6] for row in rows] == [["0", "0"], ["0", "0"]]
+    replay("fn_ptr", tmp_path / "out.bin", "format=bin")
+    subprocess.run([BIN2CSV, "--image-table", tmp_path / "out.bin", tmp_path / "converted.csv"],
+                   check=True)
+    with open(tmp_path / "converted.csv") as converted:
+        assert converted.read().splitlines() == lines
+
+def test_replay_branch_kind(tmp_path):
+    """
+    With `branch_kind=on` rows end with the kind of the callsite's branch. Only branches that may
+    fall through get a callback on the next instruction.
+    """
+    rows = replay("fn_ptr", tmp_path / "fn_ptr.csv", "mode=aggregate", "branch_kind=on")
+    assert [row[7] for row in rows] == ["call", "call"]
+    rows = replay("branch_kinds", tmp_path / "out.csv", "mode=aggregate", "branch_kind=on",
+                  "stats=json")
+    kinds = {(int(row[0], 16), int(row[1], 16)): row[7] for row in rows}
+    assert kinds == {(0x704, 0x630): "return+conditional+mode_switch",
+                     (0x714, 0x63e): "return+mode_switch"}
+    with open(tmp_path / "out.csv.stats.json") as f:
+        assert json.load(f)["callbacks"]["branch_skipped"] == 1
+
+def test_replay_callsites(tmp_path):
+    """
+    Each callsite's executions are counted by inline ops, including across retranslations after a
+    flush, and fall throughs are counted both within a block and into the next block
+    """
+    def callsites(trace):
+        replay(trace, tmp_path / (trace + ".csv"), "callsites=" + str(tmp_path / "callsites.csv"))
+        with open(tmp_path / "callsites.csv", newline='') as f:
+            return {int(row[0], 16): row[3:] for row in list(csv.reader(f))[1:]}
+    assert callsites("branch_kinds") == {
+        0x704: ["return+conditional+mode_switch", "3", "1", "2", "0.3333"],
+        0x714: ["return+mode_switch", "1", "1", "0", "1.0000"],
+        0x640: ["return+conditional+mode_switch", "1", "1", "0", "1.0000"],
+    }
+    assert callsites("hot_loop") == {0x117f: ["call", "2500", "2500", "0", "1.0000"]}
+
+@pytest.mark.parametrize("trace",["fn_ptr", "hot_loop", "arm_thumb_mixed"])
+def test_replay_prescan(tmp_path, trace):
+    """
+    Pre-scanning the ELF files, with or without a saved bitmap, doesn't change the edges found but
+    fewer instructions reach the backend without a memory map lookup for each of them
+    """
+    expected = replay(trace, tmp_path / "expected.csv", "mode=aggregate", "stats=json")
+    cache = "prescan_cache=" + str(tmp_path)
+    scanned = replay(trace, tmp_path / "scanned.csv", "mode=aggregate", "stats=json", cache)
+    assert scanned == expected
+    assert list(tmp_path.glob("*.prescan"))
+    assert replay(trace, tmp_path / "cached.csv", "mode=aggregate", "stats=json", cache) == expected
+    stats = {}
+    for name in ["expected", "scanned", "cached"]:
+        with open(tmp_path / (name + ".csv.stats.json")) as f:
+            stats[name] = json.load(f)
+    for name in ["scanned", "cached"]:
+        assert stats[name]["insns_classified"] < stats["expected"]["insns_classified"]
+        # The pre-scan reuses one memory map lookup for the whole block
+        extra_lookups = stats[name]["maps_lookups"] - stats["expected"]["maps_lookups"]
+        assert extra_lookups <= stats[name]["translations"]
+
+@pytest.mark.parametrize("filters,expected", [
+    ([], {(0x117f, 0x1000), (0x1004, 0x1010), (0x1004, 0x1139)}),
+    (["include=*/fn_ptr-static.elf"], {(0x1004, 0x1010)}),
+    (["exclude=*/fn_ptr.elf"], {(0x1004, 0x1010)}),
+    (["exclude=*/fn_ptr-static.elf"], set()),
+    (["include=*.elf", "exclude=*/fn_ptr.elf"], {(0x1004, 0x1010)}),
+])
+def test_replay_image_filters(tmp_path, filters, expected):
+    """
+    Only edges with both ends in selected images are recorded, including when a call from a selected
+    image leaves through a filtered one
+    """
+    rows = replay("two_images", tmp_path / "out.csv", "mode=aggregate", *filters)
+    assert set(edge_counts(rows)) == expected
+
+def test_replay_adaptive(tmp_path):
+    """
+    Once the callsite keeps branching to the same destination on each vCPU it's retranslated
+    without callbacks. The edges found before that are still written.
+    """
+    full = replay("hot_loop", tmp_path / "full.csv", "mode=aggregate", "stats=json")
+    adaptive = replay("hot_loop", tmp_path / "adaptive.csv", "mode=aggregate", "stats=json",
+                      "adaptive=100", "adaptive_batch=1")
+    assert set(edge_counts(adaptive)) == set(edge_counts(full))
+    assert all(count <= 101 for count in edge_counts(adaptive).values())
+    with open(tmp_path / "full.csv.stats.json") as f:
+        full_stats = json.load(f)
+    with open(tmp_path / "adaptive.csv.stats.json") as f:
+        adaptive_stats = json.load(f)
+    assert adaptive_stats["callbacks"]["indirect_branch_exec"] < \
+        full_stats["callbacks"]["indirect_branch_exec"]
+    assert adaptive_stats["translations"] > full_stats["translations"]
@@ -0,0 +1,128 @@
+// Converts the output of the plugin's binary format (`format=bin`), optionally compressed, to the csv
+// format
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compress.h"
+#include "format.h"
+#include "symbolizer.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+    const char *program = argv[0];
+    // With `--symbolize` the functions containing each callsite and destination are looked up in
+    // the ELF files so this must run where the files are at the same paths as for the guest
+    bool with_symbols = false;
+    // With `--image-table` rows refer to images by ID like the plugin's `image_table=on`
+    bool with_image_ids = false;
+    while ((argc > 1) && !strncmp(argv[1], "--", 2)) {
+        if (!strcmp(argv[1], "--symbolize")) {
+            with_symbols = true;
+        } else if (!strcmp(argv[1], "--image-table")) {
+            with_image_ids = true;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+    if ((argc != 2) && (argc != 3)) {
+        cout << "Usage: " << program << " [--symbolize] [--image-table] input.bin [output.csv]"
+             << endl;
+        return 1;
+    }
+    ifstream infile(argv[1], ios::binary);
+    if (infile.fail()) {
+        cout << "Could not open file " << argv[1] << endl;
+        return 2;
+    }
+    string raw((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    // Output written with `compress=` is decompressed first. If the guest was killed the last frame
+    // may be truncated so convert everything before it.
+    string data;
+    if (!decompress_frames(raw, data)) {
+        cerr << "WARNING: " << argv[1] << " is truncated or corrupt. Only converting the edges "
+             << "before that." << endl;
+    }
+
+    bin_decoder decoder(data);
+    if (!decoder.valid_header()) {
+        cout << "ERROR: " << argv[1] << " is not a supported binary output file" << endl;
+        return 3;
+    }
+
+    ofstream outfile;
+    if (argc == 3) {
+        outfile.open(argv[2]);
+        if (outfile.fail()) {
+            cout << "Could not open file " << argv[2] << endl;
+            return 2;
+        }
+    }
+    ostream &out = (argc == 3) ? outfile : cout;
+
+    if (with_symbols) {
+        // Decode everything once up front so the symbols can be resolved in parallel
+        bin_decoder prepass(data);
+        set<pair<uint32_t, uint64_t>> unique_offsets;
+        edge e;
+        while (prepass.next(e)) {
+            unique_offsets.insert({e.callsite.image, e.callsite.offset});
+            unique_offsets.insert({e.dst.image, e.dst.offset});
+        }
+        vector<pair<string, uint64_t>> offsets;
+        for (const auto &[image, offset] : unique_offsets) {
+            offsets.push_back({prepass.image_name(image), offset});
+        }
+        symbolizer_prepare(offsets);
+    }
+
+    string chunk = csv_header(decoder.with_count(), with_symbols, with_image_ids, false,
+                              decoder.with_profile(), decoder.sampling(), decoder.dropped());
+    csv_image_table image_table;
+    edge e;
+    profile_counts counts;
+    // Only set for value profiles
+    const profile_counts *profile = decoder.with_profile() ? &counts : NULL;
+    while (decoder.next(e, &counts)) {
+        const string &callsite_image = decoder.image_name(e.callsite.image);
+        const string &dst_image = decoder.image_name(e.dst.image);
+        string callsite_id, dst_id;
+        if (with_image_ids) {
+            for (uint32_t image : {e.callsite.image, e.dst.image}) {
+                image_table.write(chunk, image, decoder.image_bias(image),
+                                  decoder.image_build_id(image), decoder.image_name(image));
+            }
+            callsite_id = to_string(e.callsite.image);
+            dst_id = to_string(e.dst.image);
+        }
+        string_view callsite_column = with_image_ids ? callsite_id : callsite_image;
+        string_view dst_column = with_image_ids ? dst_id : dst_image;
+        if (with_symbols) {
+            format_csv_row(chunk, e, callsite_column, dst_column, decoder.with_count(), true,
+                           symbolize(callsite_image, e.callsite.offset),
+                           symbolize(dst_image, e.dst.offset), {}, profile);
+        } else {
+            format_csv_row(chunk, e, callsite_column, dst_column, decoder.with_count(), false, {},
+                           {}, {}, profile);
+        }
+        if (chunk.size() >= 1024 * 1024) {
+            out << chunk;
+            chunk.clear();
+        }
+    }
+    out << chunk;
+    out.flush();
+    // A guest killed while the plugin was writing may leave a partial record at the end
+    if (decoder.truncated()) {
+        cerr << "WARNING: " << argv[1] << " ends with a truncated or malformed record" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Reference consumer for the plugin's socket output (`output=unix:/path/to/socket`). It listens on
+// the socket, accepts a single connection and writes the payload of each frame to the output file so
+// the result is the same as if the plugin had written to the file directly (e.g. it can be converted
+// with bin2csv).
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// Read exactly `size` bytes. Returns false at the end of the stream.
+static bool read_exact(int fd, char *buf, size_t size) {
+    while (size) {
+        ssize_t n = read(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cout << "ERROR: Could not read from the socket: " << strerror(errno) << endl;
+            return false;
+        }
+        if (n == 0) {
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        cout << "Usage: " << argv[0] << " /path/to/socket output" << endl;
+        return 1;
+    }
+    const char *socket_path = argv[1];
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        cout << "Socket path " << socket_path << " is too long" << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    ofstream outfile(argv[2], ios::binary);
+    if (outfile.fail()) {
+        cout << "Could not open file " << argv[2] << endl;
+        return 2;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if ((listen_fd < 0) || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(listen_fd, 1)) {
+        cout << "Could not listen on " << socket_path << ": " << strerror(errno) << endl;
+        return 2;
+    }
+    // Tell whoever started the consumer that the plugin can connect now
+    cout << "Listening on " << socket_path << endl;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    unlink(socket_path);
+    if (fd < 0) {
+        cout << "Could not accept a connection: " << strerror(errno) << endl;
+        return 2;
+    }
+
+    size_t num_frames = 0;
+    size_t num_bytes = 0;
+    string frame;
+    uint8_t frame_header[4];
+    while (read_exact(fd, (char *)frame_header, sizeof(frame_header))) {
+        uint32_t size = frame_header[0] | (frame_header[1] << 8) | (frame_header[2] << 16) |
+                        ((uint32_t)frame_header[3] << 24);
+        frame.resize(size);
+        if (!read_exact(fd, frame.data(), size)) {
+            cout << "ERROR: The socket was closed in the middle of a frame" << endl;
+            return 3;
+        }
+        outfile.write(frame.data(), size);
+        num_frames++;
+        num_bytes += size;
+    }
+    close(fd);
+    cout << "Received " << num_frames << " frames (" << num_bytes << " bytes)" << endl;
+    return 0;
+}
@@ -0,0 +1,575 @@
+// A fake QEMU plugin host which loads the plugin and replays block translations and executions
+// from a trace file. This exercises the plugin's callbacks and memory map lookups without running
+// an emulator so they can be tested and benchmarked in-process.
+//
+// Usage: replay_host TRACE PLUGIN[,ARG=VALUE...]
+//
+// where the plugin and its arguments are given like QEMU's -plugin flag. Each line of the trace is
+// one of the following commands. Numbers are hex except for counts, vCPU indices and syscall
+// numbers. Lines starting with # are comments.
+//
+//     target NAME                       The QEMU target (e.g. x86_64, arm) passed to the plugin.
+//                                       Defaults to x86_64.
+//     map VADDR FILE OFFSET SIZE        Map SIZE bytes of FILE starting at OFFSET to the guest
+//                                       address VADDR. Relative paths are relative to the trace.
+//     anon VADDR SIZE                   Map anonymous memory (e.g. JITed code) at VADDR
+//     tb VADDR INSN...                  Define the block at VADDR with the bytes of each
+//                                       instruction, e.g. `tb 1177 488b4df8 89d6 89c7 ffd1`.
+//                                       Redefining a block (e.g. self-modifying code) drops its
+//                                       translation once the command is replayed.
+//     exec VADDR [N]                    Execute the block at VADDR, translating it first if it's
+//                                       not translated yet. If N is given only the first N
+//                                       instructions run (e.g. a fault in the middle of the block).
+//     vcpu IDX                          Execute the following commands on vCPU IDX, creating it if
+//                                       it doesn't exist yet
+//     syscall NUM [RET]                 Return from syscall NUM on the current vCPU
+//     flush                             Flush all translated blocks
+//     repeat COUNT                      Repeat the commands up to the matching `end` COUNT times
+//     end
+//
+// Guest memory is mapped at a fixed guest base so the plugin's lookups in /proc/self/maps see the
+// mapped files. vCPUs are replayed in a single thread.
+extern "C" {
+#include <qemu/qemu-plugin.h>
+}
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+typedef struct exec_cb {
+    qemu_plugin_vcpu_udata_cb_t cb;
+    void *userdata;
+} exec_cb;
+
+typedef struct inline_op {
+    uint64_t *ptr;
+    uint64_t imm;
+} inline_op;
+
+struct qemu_plugin_insn {
+    uint64_t vaddr;
+    vector<uint8_t> data;
+    vector<exec_cb> cbs;
+    vector<inline_op> inline_ops;
+};
+
+struct qemu_plugin_tb {
+    uint64_t vaddr;
+    vector<qemu_plugin_insn> insns;
+    vector<exec_cb> cbs;
+    vector<inline_op> inline_ops;
+};
+
+// A definition of a block from a `tb` command
+typedef struct block {
+    uint64_t vaddr;
+    vector<vector<uint8_t>> insns;
+    // NULL if the block is not translated
+    unique_ptr<qemu_plugin_tb> translated;
+} block;
+
+// A mapping from a `map` or `anon` command
+typedef struct guest_mapping {
+    uint64_t vaddr;
+    // Empty for anonymous mappings
+    string path;
+    uint64_t offset;
+    uint64_t size;
+} guest_mapping;
+
+typedef enum command_kind {
+    MAP,
+    DEFINE,
+    EXEC,
+    VCPU,
+    SYSCALL,
+    FLUSH,
+    REPEAT,
+    END,
+} command_kind;
+
+// A parsed trace command
+typedef struct command {
+    command_kind kind;
+    // The index in `mappings` for MAP, index in `current_blocks` for DEFINE and EXEC, vCPU index for
+    // VCPU, syscall number for SYSCALL and count for REPEAT
+    uint64_t arg;
+    // The index in `blocks` for DEFINE, number of instructions for EXEC, return value for SYSCALL
+    // and the index of the matching END for REPEAT
+    uint64_t arg2;
+} command;
+
+static const uintptr_t guest_base = 0x100000000000;
+static const qemu_plugin_id_t plugin_id = 0;
+
+static qemu_plugin_vcpu_tb_trans_cb_t tb_trans_cb = NULL;
+static vector<qemu_plugin_vcpu_syscall_ret_cb_t> syscall_ret_cbs;
+static vector<qemu_plugin_vcpu_simple_cb_t> vcpu_init_cbs;
+static vector<qemu_plugin_vcpu_simple_cb_t> vcpu_exit_cbs;
+static vector<qemu_plugin_simple_cb_t> flush_cbs;
+static vector<pair<qemu_plugin_udata_cb_t, void *>> atexit_cbs;
+// Set by `qemu_plugin_reset` and handled once the current block finishes like in QEMU
+static qemu_plugin_simple_cb_t pending_reset = NULL;
+
+static vector<guest_mapping> mappings;
+// Every definition of a block in the trace
+static vector<block> blocks;
+// The index in `blocks` of the current definition of each block vaddr, or SIZE_MAX before its first
+// `tb` command is replayed
+static vector<size_t> current_blocks;
+static unordered_map<uint64_t, size_t> block_ids;
+static vector<bool> vcpus;
+
+// Counted for the summary
+static uint64_t blocks_executed = 0;
+static uint64_t callbacks_executed = 0;
+static uint64_t translations = 0;
+
+extern "C" {
+QEMU_PLUGIN_EXPORT uintptr_t qemu_plugin_guest_base(void) { return guest_base; }
+
+QEMU_PLUGIN_EXPORT size_t qemu_plugin_tb_n_insns(const struct qemu_plugin_tb *tb) {
+    return tb->insns.size();
+}
+
+QEMU_PLUGIN_EXPORT uint64_t qemu_plugin_tb_vaddr(const struct qemu_plugin_tb *tb) {
+    return tb->vaddr;
+}
+
+QEMU_PLUGIN_EXPORT struct qemu_plugin_insn *qemu_plugin_tb_get_insn(const struct qemu_plugin_tb *tb,
+                                                                    size_t idx) {
+    if (idx >= tb->insns.size()) {
+        return NULL;
+    }
+    return const_cast<qemu_plugin_insn *>(&tb->insns[idx]);
+}
+
+QEMU_PLUGIN_EXPORT const void *qemu_plugin_insn_data(const struct qemu_plugin_insn *insn) {
+    return insn->data.data();
+}
+
+QEMU_PLUGIN_EXPORT size_t qemu_plugin_insn_size(const struct qemu_plugin_insn *insn) {
+    return insn->data.size();
+}
+
+QEMU_PLUGIN_EXPORT uint64_t qemu_plugin_insn_vaddr(const struct qemu_plugin_insn *insn) {
+    return insn->vaddr;
+}
+
+QEMU_PLUGIN_EXPORT void *qemu_plugin_insn_haddr(const struct qemu_plugin_insn *insn) {
+    return (void *)(insn->vaddr + guest_base);
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                                              qemu_plugin_vcpu_tb_trans_cb_t cb) {
+    tb_trans_cb = cb;
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
+                                                             qemu_plugin_vcpu_udata_cb_t cb,
+                                                             enum qemu_plugin_cb_flags flags,
+                                                             void *userdata) {
+    tb->cbs.push_back({cb, userdata});
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
+                                                                 enum qemu_plugin_op op, void *ptr,
+                                                                 uint64_t imm) {
+    tb->inline_ops.push_back({(uint64_t *)ptr, imm});
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
+                                                               qemu_plugin_vcpu_udata_cb_t cb,
+                                                               enum qemu_plugin_cb_flags flags,
+                                                               void *userdata) {
+    insn->cbs.push_back({cb, userdata});
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
+                                                                   enum qemu_plugin_op op,
+                                                                   void *ptr, uint64_t imm) {
+    insn->inline_ops.push_back({(uint64_t *)ptr, imm});
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_syscall_ret_cb(
+    qemu_plugin_id_t id, qemu_plugin_vcpu_syscall_ret_cb_t cb) {
+    syscall_ret_cbs.push_back(cb);
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_init_cb(qemu_plugin_id_t id,
+                                                          qemu_plugin_vcpu_simple_cb_t cb) {
+    vcpu_init_cbs.push_back(cb);
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_vcpu_exit_cb(qemu_plugin_id_t id,
+                                                          qemu_plugin_vcpu_simple_cb_t cb) {
+    vcpu_exit_cbs.push_back(cb);
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_flush_cb(qemu_plugin_id_t id,
+                                                      qemu_plugin_simple_cb_t cb) {
+    flush_cbs.push_back(cb);
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                                       qemu_plugin_udata_cb_t cb, void *userdata) {
+    atexit_cbs.push_back({cb, userdata});
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_reset(qemu_plugin_id_t id, qemu_plugin_simple_cb_t cb) {
+    pending_reset = cb;
+}
+
+QEMU_PLUGIN_EXPORT void qemu_plugin_outs(const char *string) { cout << string; }
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_n_vcpus(void) { return -1; }
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_n_max_vcpus(void) { return -1; }
+}
+
+static void flush_blocks() {
+    for (block &b : blocks) {
+        b.translated.reset();
+    }
+}
+
+// Like QEMU, a reset flushes the translated blocks and removes all of the plugin's callbacks before
+// calling the reset callback
+static void handle_reset() {
+    qemu_plugin_simple_cb_t cb = pending_reset;
+    pending_reset = NULL;
+    flush_blocks();
+    tb_trans_cb = NULL;
+    syscall_ret_cbs.clear();
+    vcpu_init_cbs.clear();
+    vcpu_exit_cbs.clear();
+    flush_cbs.clear();
+    atexit_cbs.clear();
+    cb(plugin_id);
+}
+
+static qemu_plugin_tb *translate(block &b) {
+    auto tb = make_unique<qemu_plugin_tb>();
+    tb->vaddr = b.vaddr;
+    uint64_t vaddr = b.vaddr;
+    for (const vector<uint8_t> &data : b.insns) {
+        tb->insns.push_back({.vaddr = vaddr, .data = data, .cbs = {}, .inline_ops = {}});
+        vaddr += data.size();
+    }
+    if (tb_trans_cb) {
+        tb_trans_cb(plugin_id, tb.get());
+    }
+    translations++;
+    b.translated = move(tb);
+    return b.translated.get();
+}
+
+static void exec_block(block &b, size_t num_insns, unsigned int vcpu_idx) {
+    qemu_plugin_tb *tb = b.translated ? b.translated.get() : translate(b);
+    for (const exec_cb &cb : tb->cbs) {
+        cb.cb(vcpu_idx, cb.userdata);
+    }
+    for (const inline_op &op : tb->inline_ops) {
+        *op.ptr += op.imm;
+    }
+    callbacks_executed += tb->cbs.size();
+    size_t n = min(num_insns, tb->insns.size());
+    for (size_t i = 0; i < n; i++) {
+        const qemu_plugin_insn &insn = tb->insns[i];
+        for (const inline_op &op : insn.inline_ops) {
+            *op.ptr += op.imm;
+        }
+        for (const exec_cb &cb : insn.cbs) {
+            cb.cb(vcpu_idx, cb.userdata);
+        }
+        callbacks_executed += insn.cbs.size();
+    }
+    blocks_executed++;
+    if (pending_reset) {
+        handle_reset();
+    }
+}
+
+static void use_vcpu(unsigned int vcpu_idx) {
+    if (vcpu_idx >= vcpus.size()) {
+        vcpus.resize(vcpu_idx + 1);
+    }
+    if (!vcpus[vcpu_idx]) {
+        vcpus[vcpu_idx] = true;
+        for (qemu_plugin_vcpu_simple_cb_t cb : vcpu_init_cbs) {
+            cb(plugin_id, vcpu_idx);
+        }
+    }
+}
+
+static void map_guest(const guest_mapping &m) {
+    int fd = m.path.empty() ? -1 : open(m.path.c_str(), O_RDONLY);
+    if (!m.path.empty() && (fd < 0)) {
+        cerr << "Could not open file " << m.path << endl;
+        exit(5);
+    }
+    int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE | (m.path.empty() ? MAP_ANONYMOUS : 0);
+    void *addr = mmap((void *)(guest_base + m.vaddr), m.size, PROT_READ, flags, fd, m.offset);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (addr == MAP_FAILED) {
+        cerr << "Could not map 0x" << hex << m.vaddr << dec << ": " << strerror(errno) << endl;
+        exit(5);
+    }
+}
+
+static bool parse_error(size_t line_num, const string &line) {
+    cerr << "Invalid trace command on line " << line_num << ": " << line << endl;
+    return false;
+}
+
+// Parse the trace into `commands`
+static bool parse_trace(istream &trace, const string &trace_dir, vector<command> &commands) {
+    vector<size_t> open_repeats;
+    string line;
+    for (size_t line_num = 1; getline(trace, line); line_num++) {
+        istringstream in(line);
+        string cmd;
+        if (!(in >> cmd) || (cmd[0] == '#')) {
+            continue;
+        }
+        if (cmd == "target") {
+            // Handled before the plugin is installed
+        } else if ((cmd == "map") || (cmd == "anon")) {
+            guest_mapping m = {.vaddr = 0, .path = "", .offset = 0, .size = 0};
+            in >> hex >> m.vaddr;
+            if (cmd == "map") {
+                in >> m.path >> m.offset;
+                if (!m.path.empty() && (m.path[0] != '/')) {
+                    m.path = trace_dir + m.path;
+                }
+            }
+            if (!(in >> m.size) || ((cmd == "map") && m.path.empty())) {
+                return parse_error(line_num, line);
+            }
+            commands.push_back({MAP, mappings.size(), 0});
+            mappings.push_back(m);
+        } else if (cmd == "tb") {
+            block b = {};
+            string bytes;
+            in >> hex >> b.vaddr;
+            while (in >> bytes) {
+                vector<uint8_t> data;
+                for (size_t i = 0; i + 1 < bytes.size(); i += 2) {
+                    data.push_back(stoul(bytes.substr(i, 2), NULL, 16));
+                }
+                b.insns.push_back(data);
+            }
+            if (in.bad() || b.insns.empty()) {
+                return parse_error(line_num, line);
+            }
+            auto [it, inserted] = block_ids.insert({b.vaddr, current_blocks.size()});
+            if (inserted) {
+                current_blocks.push_back(SIZE_MAX);
+            }
+            commands.push_back({DEFINE, it->second, blocks.size()});
+            blocks.push_back(move(b));
+        } else if (cmd == "exec") {
+            uint64_t vaddr, num_insns = SIZE_MAX;
+            if (!(in >> hex >> vaddr) || !block_ids.count(vaddr)) {
+                return parse_error(line_num, line);
+            }
+            in >> dec >> num_insns;
+            commands.push_back({EXEC, block_ids[vaddr], num_insns});
+        } else if (cmd == "vcpu") {
+            uint64_t vcpu_idx;
+            if (!(in >> dec >> vcpu_idx)) {
+                return parse_error(line_num, line);
+            }
+            commands.push_back({VCPU, vcpu_idx, 0});
+        } else if (cmd == "syscall") {
+            uint64_t num;
+            int64_t ret = 0;
+            if (!(in >> dec >> num)) {
+                return parse_error(line_num, line);
+            }
+            in >> ret;
+            commands.push_back({SYSCALL, num, (uint64_t)ret});
+        } else if (cmd == "flush") {
+            commands.push_back({FLUSH, 0, 0});
+        } else if (cmd == "repeat") {
+            uint64_t count;
+            if (!(in >> dec >> count)) {
+                return parse_error(line_num, line);
+            }
+            open_repeats.push_back(commands.size());
+            commands.push_back({REPEAT, count, 0});
+        } else if (cmd == "end") {
+            if (open_repeats.empty()) {
+                return parse_error(line_num, line);
+            }
+            commands[open_repeats.back()].arg2 = commands.size();
+            commands.push_back({END, open_repeats.back(), 0});
+            open_repeats.pop_back();
+        } else {
+            return parse_error(line_num, line);
+        }
+    }
+    if (!open_repeats.empty()) {
+        cerr << "Missing `end` for `repeat` in trace" << endl;
+        return false;
+    }
+    return true;
+}
+
+static void replay(const vector<command> &commands) {
+    unsigned int vcpu_idx = 0;
+    use_vcpu(vcpu_idx);
+    // The remaining iterations of each active `repeat`
+    vector<uint64_t> remaining;
+    for (size_t pc = 0; pc < commands.size(); pc++) {
+        const command &cmd = commands[pc];
+        switch (cmd.kind) {
+            case MAP:
+                map_guest(mappings[cmd.arg]);
+                break;
+            case DEFINE: {
+                // Like QEMU invalidating the blocks of modified code, the old definition's
+                // translation is dropped
+                size_t &current = current_blocks[cmd.arg];
+                if (current != SIZE_MAX) {
+                    blocks[current].translated.reset();
+                }
+                current = cmd.arg2;
+                break;
+            }
+            case EXEC:
+                if (current_blocks[cmd.arg] == SIZE_MAX) {
+                    cerr << "Block executed before it's defined" << endl;
+                    exit(4);
+                }
+                exec_block(blocks[current_blocks[cmd.arg]], cmd.arg2, vcpu_idx);
+                break;
+            case VCPU:
+                vcpu_idx = cmd.arg;
+                use_vcpu(vcpu_idx);
+                break;
+            case SYSCALL:
+                for (qemu_plugin_vcpu_syscall_ret_cb_t cb : syscall_ret_cbs) {
+                    cb(plugin_id, vcpu_idx, cmd.arg, cmd.arg2);
+                }
+                break;
+            case FLUSH:
+                flush_blocks();
+                for (qemu_plugin_simple_cb_t cb : flush_cbs) {
+                    cb(plugin_id);
+                }
+                break;
+            case REPEAT:
+                if (cmd.arg == 0) {
+                    pc = cmd.arg2;
+                } else {
+                    remaining.push_back(cmd.arg);
+                }
+                break;
+            case END:
+                if (--remaining.back() > 0) {
+                    pc = cmd.arg;
+                } else {
+                    remaining.pop_back();
+                }
+                break;
+        }
+    }
+    for (unsigned int i = 0; i < vcpus.size(); i++) {
+        if (vcpus[i]) {
+            for (qemu_plugin_vcpu_simple_cb_t cb : vcpu_exit_cbs) {
+                cb(plugin_id, i);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        cout << "Usage: " << argv[0] << " TRACE PLUGIN[,ARG=VALUE...]" << endl;
+        return 1;
+    }
+    const char *trace_path = argv[1];
+    ifstream trace(trace_path);
+    if (trace.fail()) {
+        cout << "Could not open file " << trace_path << endl;
+        return 2;
+    }
+    string trace_dir = trace_path;
+    trace_dir = trace_dir.substr(0, trace_dir.find_last_of('/') + 1);
+
+    // Split the plugin path and arguments like QEMU's -plugin flag
+    vector<string> plugin_args;
+    istringstream plugin_arg(argv[2]);
+    string arg;
+    while (getline(plugin_arg, arg, ',')) {
+        plugin_args.push_back(arg);
+    }
+    void *handle = dlopen(plugin_args[0].c_str(), RTLD_NOW);
+    if (!handle) {
+        cout << "Could not open plugin " << plugin_args[0] << endl;
+        cout << dlerror() << endl;
+        return 2;
+    }
+    auto install = (int (*)(qemu_plugin_id_t, const qemu_info_t *, int, char **))dlsym(
+        handle, "qemu_plugin_install");
+    if (!install) {
+        cout << dlerror() << endl;
+        return 2;
+    }
+
+    // The target must be known before parsing the trace since `tb` commands translate blocks
+    string line, target = "x86_64";
+    while (getline(trace, line)) {
+        istringstream in(line);
+        string cmd;
+        if ((in >> cmd) && (cmd == "target")) {
+            in >> target;
+        }
+    }
+    trace.clear();
+    trace.seekg(0);
+
+    qemu_info_t info = {};
+    info.target_name = target.c_str();
+    vector<char *> install_argv;
+    for (size_t i = 1; i < plugin_args.size(); i++) {
+        install_argv.push_back(plugin_args[i].data());
+    }
+    int ret = install(plugin_id, &info, install_argv.size(), install_argv.data());
+    if (ret) {
+        cout << "Plugin install failed with " << ret << endl;
+        return 3;
+    }
+
+    vector<command> commands;
+    if (!parse_trace(trace, trace_dir, commands)) {
+        return 4;
+    }
+    auto start = chrono::steady_clock::now();
+    replay(commands);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (auto &[cb, userdata] : atexit_cbs) {
+        cb(plugin_id, userdata);
+    }
+    cerr << "Replayed " << blocks_executed << " blocks (" << translations << " translations) and "
+         << callbacks_executed << " callbacks in " << seconds << " s ("
+         << (seconds > 0 ? callbacks_executed / seconds : 0) << " callbacks/s)" << endl;
+    return 0;
+}